@@ -19,10 +19,12 @@
 #define _itkBeadSpreadFunctionImageSource_h
 
 #include "itkParametricImageSource.h"
-#include "itkShiftScaleImageFilter.h"
 #include "itkSphereConvolutionFilter.h"
 #include "itkCommand.h"
 
+#include <list>
+#include <vector>
+
 namespace itk
 {
 
@@ -32,6 +34,11 @@ namespace itk
  * convolution of a sphere with a ParametricImageSource that generates
  * a convolution kernel.
  *
+ * Only the requested region of the output is generated, and the
+ * kernel table is sized to cover that region alone, so restricting the
+ * requested region to the voxels a metric compares saves both the
+ * kernel generation and the convolution outside them.
+ *
  * \ingroup DataSources Multithreaded
 */
 template < class TOutputImage >
@@ -68,10 +75,6 @@ public:
     ConvolverType;
   typedef typename ConvolverType::Pointer
     ConvolverPointer;
-  typedef ShiftScaleImageFilter< TOutputImage, TOutputImage >
-    RescaleImageFilterType;
-  typedef typename RescaleImageFilterType::Pointer
-    RescaleImageFilterPointer;
 
   /** Run-time type information (and related methods). */
   itkTypeMacro(BeadSpreadFunctionImageSource,ParametricImageSource);
@@ -81,6 +84,8 @@ public:
 
   typedef typename Superclass::ParametersValueType ParametersValueType;
   typedef typename Superclass::ParametersType      ParametersType;
+  typedef typename Superclass::ParametersMaskType  ParametersMaskType;
+  typedef typename Superclass::JacobianType        JacobianType;
 
   /** Set/get the size of the output image. */
   void SetSize(const SizeType & size);
@@ -129,6 +134,88 @@ public:
   itkGetMacro(KernelIsRadiallySymmetric, bool);
   itkBooleanMacro(KernelIsRadiallySymmetric);
 
+  /** Policies for the spacing of the kernel table. */
+  typedef enum {
+    FIXED_KERNEL_TABLE_SPACING,
+    ADAPTIVE_KERNEL_TABLE_SPACING
+  } KernelTableSpacingPolicyType;
+
+  /** Set/get the policy for the spacing of the kernel table. The fixed
+   * policy uses KernelTableSpacing along every dimension. The adaptive
+   * policy samples the kernel no finer than needed: along each
+   * dimension the spacing is the smaller of the Nyquist spacing of the
+   * microscope and the output spacing, divided by
+   * KernelTableOversampling. The Nyquist spacing is lambda/(4 NA)
+   * laterally and lambda/(2 NA) axially, which is finer than needed
+   * for any immersion refractive index. Kernel sources that are not
+   * widefield microscope PSF sources have no Nyquist spacing, so the
+   * output spacing alone is used for them. Defaults to fixed. */
+  void SetKernelTableSpacingPolicyToFixed()
+  {
+    if (m_KernelTableSpacingPolicy != FIXED_KERNEL_TABLE_SPACING)
+      {
+      m_KernelTableSpacingPolicy = FIXED_KERNEL_TABLE_SPACING;
+      this->Modified();
+      }
+  }
+
+  void SetKernelTableSpacingPolicyToAdaptive()
+  {
+    if (m_KernelTableSpacingPolicy != ADAPTIVE_KERNEL_TABLE_SPACING)
+      {
+      m_KernelTableSpacingPolicy = ADAPTIVE_KERNEL_TABLE_SPACING;
+      this->Modified();
+      }
+  }
+
+  itkGetConstMacro(KernelTableSpacingPolicy, KernelTableSpacingPolicyType);
+
+  /** Set/get the kernel table spacing of the fixed policy (in
+   * nanometers). Defaults to 50. */
+  itkSetMacro(KernelTableSpacing, double);
+  itkGetConstMacro(KernelTableSpacing, double);
+
+  /** Set/get the factor by which the adaptive policy samples the
+   * kernel more finely than the Nyquist or output spacing. Defaults
+   * to 1. */
+  itkSetMacro(KernelTableOversampling, double);
+  itkGetConstMacro(KernelTableOversampling, double);
+
+  /** Set/get the fraction of the kernel energy that may be cropped
+   * from the kernel table. After the kernel is generated, planes are
+   * peeled off the faces of the table, lowest energy first, as long
+   * as the energy removed stays below this fraction of the total,
+   * bounded from above by the sum of the energies of the peeled
+   * planes. The convolver treats the kernel as zero outside the table
+   * and constant above its top, as it does for the full table, so
+   * scanning and lookups work on a smaller table. Radial tables are
+   * only cropped at large radii, and the energy of their columns is
+   * weighted by the radius. A tolerance of zero keeps the full table.
+   * Defaults to zero. */
+  itkSetMacro(KernelTableEnergyTolerance, double);
+  itkGetConstMacro(KernelTableEnergyTolerance, double);
+
+  /** Set/get the margin added around the kernel table extent (in
+   * nanometers). The table extent follows the bead center, so a step
+   * of the bead center would otherwise change the table geometry and
+   * regenerate the kernel. As long as the kernel parameters are
+   * unchanged and the extent needed fits in the current table, the
+   * current table is reused and only the convolution is executed.
+   * When a new table is generated, it is padded by this margin on
+   * every side, or only at large radii for radial tables, so that
+   * bead center steps up to the margin fit. Defaults to zero. */
+  itkSetMacro(KernelTableMargin, double);
+  itkGetConstMacro(KernelTableMargin, double);
+
+  /** Set/get the method used to convolve the bead with the kernel.
+   * The FFT method is cheaper for large outputs and for updates that
+   * only move the bead, while the chord method resolves the bead
+   * surface more finely than the kernel spacing. See
+   * SphereConvolutionFilter. Defaults to the chord method. */
+  void SetConvolutionMethodToChords();
+  void SetConvolutionMethodToFFT();
+  typename ConvolverType::ConvolutionMethod GetConvolutionMethod() const;
+
   /** Set/get a single parameter value. */
   virtual void SetParameter(unsigned int index, ParametersValueType value);
   virtual ParametersValueType GetParameter(unsigned int index) const;
@@ -145,6 +232,19 @@ public:
   /** Gets the number of bead-spread function parameters. */
   virtual unsigned int GetNumberOfBeadSpreadFunctionParameters() const;
 
+  /** Generates the output image and its derivatives with respect to
+   * the parameters in the mask. The output is the intensity shift
+   * plus the intensity scale times the convolution of the bead with
+   * the kernel. The derivatives with respect to the shift and scale
+   * follow directly. Because the convolution is linear in the kernel,
+   * the derivatives with respect to the kernel parameters are the
+   * scaled convolutions of the kernel derivatives, which come from
+   * the kernel source's GenerateJacobian(). The derivatives with
+   * respect to the spacing, bead radius, bead center and shear are
+   * computed by central differences. */
+  virtual void GenerateJacobian(const ParametersMaskType& mask,
+                                JacobianType& jacobian);
+
   /** Get/set the z-coordinate of the image z-plane at the given index. */
   void SetZCoordinate(unsigned int index, double coordinate);
   double GetZCoordinate(unsigned int);
@@ -153,6 +253,57 @@ public:
   void SetUseCustomZCoordinates(bool use);
   bool GetUseCustomZCoordinates();
 
+  /** Set/get the maximum number of bytes used by the kernel cache.
+   * Generated kernel tables and their scans are cached by kernel
+   * parameter vector and table geometry, and the least recently used
+   * entries are evicted when the cache exceeds this size. Optimizers
+   * that revisit parameter values then skip regenerating the kernel.
+   * Changing a setting of the kernel source that is not among its
+   * parameters, e.g., its number of integration subdivisions, empties
+   * the cache in the next update. A size of zero disables the cache.
+   * Defaults to 128 MiB. */
+  void SetKernelCacheMaximumSize(unsigned long size);
+  itkGetConstMacro(KernelCacheMaximumSize, unsigned long);
+
+  /** Get the number of bytes used by the kernel cache. */
+  itkGetConstMacro(KernelCacheSize, unsigned long);
+
+  /** Get the number of updates that found the kernel in the cache. */
+  itkGetConstMacro(KernelCacheHits, unsigned long);
+
+  /** Get the number of updates that had to generate the kernel. */
+  itkGetConstMacro(KernelCacheMisses, unsigned long);
+
+  /** Remove all entries from the kernel cache. */
+  void ClearKernelCache();
+
+  /** Reset the kernel cache hit and miss counts. */
+  void ResetKernelCacheStatistics();
+
+  /** Pipeline stages of the bead-spread function. Generating the
+   * kernel table is the most expensive stage, followed by convolving
+   * it with the bead, followed by shifting and scaling the
+   * intensities. */
+  typedef enum {
+    KERNEL_STAGE,
+    CONVOLUTION_STAGE,
+    RESCALE_STAGE
+  } PipelineStageType;
+
+  /** Gets the earliest pipeline stage invalidated by a change of the
+   * parameter at the given index. Only the invalidated stages are
+   * executed in the next update. Changes to the spacing, bead radius
+   * and bead center invalidate the kernel stage as well when they
+   * change the extent of the kernel table. */
+  PipelineStageType GetParameterStage(unsigned int index) const;
+
+  /** Get the number of updates that produced a new kernel table,
+   * either by generating it or by fetching it from the cache. */
+  itkGetConstMacro(NumberOfKernelUpdates, unsigned long);
+
+  /** Get the number of updates that executed the convolution. */
+  itkGetConstMacro(NumberOfConvolutionUpdates, unsigned long);
+
   /** Callback evoked whenever the KernelSource is modified. */
   virtual void KernelModified();
 
@@ -168,6 +319,23 @@ protected:
 
   virtual void GenerateOutputInformation();
 
+  /** Computes the origin, spacing and size of the kernel table needed
+   * to cover the requested region of the output image. */
+  void ComputeKernelTableGeometry(PointType& origin, SpacingType& spacing,
+                                  SizeType& size);
+
+  /** Returns whether the current kernel table covers a table of the
+   * given geometry. */
+  bool KernelTableCovers(const PointType& origin, const SpacingType& spacing,
+                         const SizeType& size) const;
+
+  /** Computes the kernel table spacing under the spacing policy. */
+  void ComputeKernelTableSpacing(SpacingType& spacing) const;
+
+  /** Returns the region of a kernel table that holds all but the
+   * energy tolerance of its energy. */
+  RegionType ComputeKernelTableCropRegion(const OutputImageType* kernel) const;
+
 private:
   BeadSpreadFunctionImageSource(const BeadSpreadFunctionImageSource&); // purposely not implemented
   void operator=(const BeadSpreadFunctionImageSource&); // purposely not implemented
@@ -177,13 +345,93 @@ private:
 
   KernelImageSourcePointer  m_KernelSource;
   bool                      m_KernelIsRadiallySymmetric;
+
+  KernelTableSpacingPolicyType m_KernelTableSpacingPolicy;
+  double                       m_KernelTableSpacing;
+  double                       m_KernelTableOversampling;
+  double                       m_KernelTableEnergyTolerance;
+  double                       m_KernelTableMargin;
+
+  /** Geometry of the kernel table feeding the convolver. */
+  PointType                    m_CurrentKernelTableOrigin;
+  SpacingType                  m_CurrentKernelTableSpacing;
+  SizeType                     m_CurrentKernelTableSize;
   ConvolverPointer          m_Convolver;
-  RescaleImageFilterPointer m_RescaleFilter;
+
+  /** Intensity shift and scale applied to the convolver output. */
+  double                    m_AppliedIntensityShift;
+  double                    m_AppliedIntensityScale;
+
+  /** Convolves kernel derivatives with the bead. */
+  ConvolverPointer          m_JacobianConvolver;
+
+  /** Copies the bead and output geometry of the convolver to the
+   * jacobian convolver. */
+  void ConfigureJacobianConvolver();
 
   typedef SimpleMemberCommand< Self > MemberCommandType;
   typedef typename MemberCommandType::Pointer MemberCommandPointer;
   MemberCommandPointer m_ModifiedEventCommand;
   unsigned long        m_ObserverTag;
+
+  /** Kernel cache entry holding a copy of a kernel table and its
+   * scan, keyed by the kernel parameters and table geometry. */
+  typedef typename OutputImageType::Pointer OutputImagePointer;
+  typedef std::vector< double >             KernelCacheKeyType;
+  struct KernelCacheEntry
+  {
+    KernelCacheKeyType key;
+    OutputImagePointer kernel;
+    OutputImagePointer scannedKernel;
+    unsigned long      size;
+  };
+  typedef std::list< KernelCacheEntry > KernelCacheType;
+
+  /** Entries ordered from most to least recently used. */
+  KernelCacheType m_KernelCache;
+  unsigned long   m_KernelCacheMaximumSize;
+  unsigned long   m_KernelCacheSize;
+  unsigned long   m_KernelCacheHits;
+  unsigned long   m_KernelCacheMisses;
+
+  /** Builds the cache key for the current kernel parameters, the
+   * given table geometry, and the table spacing policy and energy
+   * tolerance. */
+  KernelCacheKeyType MakeKernelCacheKey(const PointType& origin,
+                                        const SpacingType& spacing,
+                                        const SizeType& size) const;
+
+  /** Key, kernel source modification time, and stage counts of the
+   * kernel table feeding the convolver. */
+  KernelCacheKeyType m_KernelKey;
+  unsigned long      m_KernelSourceMTime;
+  unsigned long      m_NumberOfKernelUpdates;
+  unsigned long      m_NumberOfConvolutionUpdates;
+
+  /** Modification time of the kernel source once its settings outside
+   * the cache key were last validated. Changes made by this source
+   * advance it through KernelSourceChanged(); any other change to the
+   * kernel source leaves it behind, which empties the cache in the
+   * next update. */
+  unsigned long m_KernelSettingsMTime;
+
+  /** Records a change this source made to the kernel source, given
+   * the kernel source's modification time before the change. */
+  void KernelSourceChanged(unsigned long previousMTime);
+
+  /** Sets the convolver input to the kernel table for the given key,
+   * from the cache if possible. Returns true if the kernel was
+   * generated and should be added to the cache once its scan has
+   * been computed. */
+  bool UpdateKernel(const KernelCacheKeyType& key);
+
+  /** Adds copies of the current kernel table and its scan to the
+   * cache and evicts entries beyond the maximum size. */
+  void AddKernelCacheEntry(const KernelCacheKeyType& key);
+
+  /** Evicts least recently used entries until the cache fits within
+   * the maximum size. */
+  void TrimKernelCache();
 };
 
 } // end namespace itk
@@ -19,6 +19,14 @@
 #define _itkBeadSpreadFunctionImageSource_txx
 
 #include "itkBeadSpreadFunctionImageSource.h"
+#include "itkImageDuplicator.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
+#include "itkRegionOfInterestImageFilter.h"
+#include "itkWidefieldMicroscopePointSpreadFunctionImageSource.h"
+
+#include <algorithm>
+#include <cmath>
 
 
 namespace itk
@@ -34,6 +42,15 @@ BeadSpreadFunctionImageSource< TOutputImage >
   m_KernelSource = NULL;
   m_KernelIsRadiallySymmetric = false;
 
+  m_KernelTableSpacingPolicy   = FIXED_KERNEL_TABLE_SPACING;
+  m_KernelTableSpacing         = 50.0; // An arbitrary spacing
+  m_KernelTableOversampling    = 1.0;
+  m_KernelTableEnergyTolerance = 0.0;
+  m_KernelTableMargin          = 0.0;
+  m_CurrentKernelTableOrigin.Fill(0.0);
+  m_CurrentKernelTableSpacing.Fill(0.0);
+  m_CurrentKernelTableSize.Fill(0);
+
   m_Convolver = ConvolverType::New();
 
   // Specify multiple integration samples in x and y but not z.
@@ -41,12 +58,24 @@ BeadSpreadFunctionImageSource< TOutputImage >
   m_Convolver->SetNumberOfIntegrationSamples(voxelSamples);
   m_Convolver->WeightIntegrationByAreaOn();
 
-  m_RescaleFilter = RescaleImageFilterType::New();
-  m_RescaleFilter->SetInput(m_Convolver->GetOutput());
+  m_AppliedIntensityShift = 0.0;
+  m_AppliedIntensityScale = 1.0;
+
+  m_JacobianConvolver = ConvolverType::New();
 
   m_ModifiedEventCommand = MemberCommandType::New();
   m_ModifiedEventCommand->SetCallbackFunction(this, &Self::KernelModified);
   m_ObserverTag = 0;
+
+  m_KernelCacheMaximumSize = 128*1024*1024;
+  m_KernelCacheSize        = 0;
+  m_KernelCacheHits        = 0;
+  m_KernelCacheMisses      = 0;
+
+  m_KernelSourceMTime          = 0;
+  m_KernelSettingsMTime        = 0;
+  m_NumberOfKernelUpdates      = 0;
+  m_NumberOfConvolutionUpdates = 0;
 }
 
 
@@ -177,6 +206,43 @@ BeadSpreadFunctionImageSource< TOutputImage >
 }
 
 
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::SetConvolutionMethodToChords()
+{
+  if (m_Convolver->GetConvolutionMethod() != ConvolverType::CHORD_CONVOLUTION)
+    {
+    m_Convolver->SetConvolutionMethodToChords();
+    m_JacobianConvolver->SetConvolutionMethodToChords();
+    this->Modified();
+    }
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::SetConvolutionMethodToFFT()
+{
+  if (m_Convolver->GetConvolutionMethod() != ConvolverType::FFT_CONVOLUTION)
+    {
+    m_Convolver->SetConvolutionMethodToFFT();
+    m_JacobianConvolver->SetConvolutionMethodToFFT();
+    this->Modified();
+    }
+}
+
+
+template< class TOutputImage >
+typename BeadSpreadFunctionImageSource< TOutputImage >::ConvolverType::ConvolutionMethod
+BeadSpreadFunctionImageSource< TOutputImage >
+::GetConvolutionMethod() const
+{
+  return m_Convolver->GetConvolutionMethod();
+}
+
+
 template< class TOutputImage >
 void
 BeadSpreadFunctionImageSource< TOutputImage >
@@ -235,6 +301,7 @@ BeadSpreadFunctionImageSource< TOutputImage >
     this->m_KernelSource = source;
     this->m_ObserverTag = this->m_KernelSource->
       AddObserver(ModifiedEvent() , m_ModifiedEventCommand);
+    this->ClearKernelCache();
     this->Modified();
     }
 
@@ -291,7 +358,9 @@ BeadSpreadFunctionImageSource< TOutputImage >
     }
   else
     {
+    unsigned long kernelMTime = this->m_KernelSource->GetMTime();
     this->m_KernelSource->SetParameter(index - numberOfBSFParameters, value);
+    this->KernelSourceChanged(kernelMTime);
     }
 }
 
@@ -389,7 +458,9 @@ BeadSpreadFunctionImageSource< TOutputImage >
     kernelParameters[i] = parameters[index++];
     }
 
+  unsigned long kernelMTime = this->m_KernelSource->GetMTime();
   this->m_KernelSource->SetParameters(kernelParameters);
+  this->KernelSourceChanged(kernelMTime);
 }
 
 
@@ -450,6 +521,173 @@ BeadSpreadFunctionImageSource< TOutputImage >
   return 2*ImageDimension + 5;
 }
 
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::GenerateJacobian(const ParametersMaskType& mask, JacobianType& jacobian)
+{
+  unsigned int numberOfParameters    = this->GetNumberOfParameters();
+  unsigned int numberOfBSFParameters = this->GetNumberOfBeadSpreadFunctionParameters();
+  unsigned int shiftIndex = 2*ImageDimension + 3;
+  unsigned int scaleIndex = 2*ImageDimension + 4;
+
+  jacobian.assign(numberOfParameters, OutputImagePointer());
+
+  // Central differences for the parameters that change the geometry
+  // of the convolution. This also leaves the output up to date.
+  ParametersMaskType geometryMask(numberOfParameters);
+  geometryMask.Fill(0);
+  bool differenceGeometry = false;
+  for (unsigned int i = 0; i < numberOfBSFParameters; i++)
+    {
+    if (mask[i] && this->GetParameterStage(i) == CONVOLUTION_STAGE)
+      {
+      geometryMask[i] = 1;
+      differenceGeometry = true;
+      }
+    }
+
+  if (differenceGeometry)
+    {
+    this->GenerateFiniteDifferenceJacobian(geometryMask, jacobian);
+    }
+  else
+    {
+    this->Update();
+    }
+
+  if (mask[shiftIndex])
+    {
+    jacobian[shiftIndex] = this->NewJacobianImage();
+    jacobian[shiftIndex]->FillBuffer(NumericTraits< PixelType >::One);
+    }
+
+  // The derivative with respect to the scale is the convolution
+  // itself, which the convolver output holds shifted and scaled.
+  if (mask[scaleIndex])
+    {
+    typedef ImageDuplicator< OutputImageType > DuplicatorType;
+    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+    if (m_IntensityScale != 0.0)
+      {
+      duplicator->SetInputImage(m_Convolver->GetOutput());
+      duplicator->Update();
+      OutputImagePointer derivative = duplicator->GetOutput();
+      ImageRegionIterator< OutputImageType >
+        it(derivative, derivative->GetBufferedRegion());
+      for (; !it.IsAtEnd(); ++it)
+        {
+        it.Set( static_cast< PixelType >
+                ((it.Get() - m_IntensityShift) / m_IntensityScale) );
+        }
+      jacobian[scaleIndex] = derivative;
+      }
+    else
+      {
+      this->ConfigureJacobianConvolver();
+      m_JacobianConvolver->SetInput(m_Convolver->GetInput());
+      m_JacobianConvolver->Update();
+      duplicator->SetInputImage(m_JacobianConvolver->GetOutput());
+      duplicator->Update();
+      jacobian[scaleIndex] = duplicator->GetOutput();
+      m_JacobianConvolver->SetInput(NULL);
+      }
+    }
+
+  ParametersMaskType kernelMask(numberOfParameters - numberOfBSFParameters);
+  kernelMask.Fill(0);
+  bool differentiateKernel = false;
+  for (unsigned int i = 0; i < kernelMask.GetSize(); i++)
+    {
+    if (mask[numberOfBSFParameters + i])
+      {
+      kernelMask[i] = 1;
+      differentiateKernel = true;
+      }
+    }
+
+  if (!differentiateKernel)
+    {
+    return;
+    }
+
+  // The kernel source is left with the kernel table geometry set in
+  // the last update, so its derivatives are sampled like the table.
+  JacobianType kernelJacobian;
+  unsigned long kernelMTime = m_KernelSource->GetMTime();
+  m_KernelSource->GenerateJacobian(kernelMask, kernelJacobian);
+  this->KernelSourceChanged(kernelMTime);
+
+  // The kernel source regenerates its output for the derivatives, but
+  // leaves its parameters as they were, so a current kernel table
+  // stays current and the next update need not convolve again.
+  if (kernelMTime == m_KernelSourceMTime)
+    {
+    m_KernelSourceMTime = m_KernelSource->GetMTime();
+    }
+
+  this->ConfigureJacobianConvolver();
+  for (unsigned int i = 0; i < kernelJacobian.size(); i++)
+    {
+    if (!kernelJacobian[i])
+      {
+      continue;
+      }
+
+    m_JacobianConvolver->SetInput(kernelJacobian[i]);
+    m_JacobianConvolver->Update();
+
+    typedef ImageDuplicator< OutputImageType > DuplicatorType;
+    typename DuplicatorType::Pointer duplicator = DuplicatorType::New();
+    duplicator->SetInputImage(m_JacobianConvolver->GetOutput());
+    duplicator->Update();
+
+    OutputImagePointer derivative = duplicator->GetOutput();
+    ImageRegionIterator< OutputImageType >
+      it(derivative, derivative->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+      {
+      it.Set( static_cast< PixelType >(m_IntensityScale * it.Get()) );
+      }
+    jacobian[numberOfBSFParameters + i] = derivative;
+    }
+
+  // Release the kernel derivatives.
+  m_JacobianConvolver->SetInput(NULL);
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::ConfigureJacobianConvolver()
+{
+  m_JacobianConvolver->SetSize(m_Convolver->GetSize());
+  m_JacobianConvolver->SetSpacing(m_Convolver->GetSpacing());
+  m_JacobianConvolver->SetOrigin(m_Convolver->GetOrigin());
+  m_JacobianConvolver->SetSphereCenter(m_Convolver->GetSphereCenter());
+  m_JacobianConvolver->SetSphereRadius(m_Convolver->GetSphereRadius());
+  m_JacobianConvolver->SetShearX(m_Convolver->GetShearX());
+  m_JacobianConvolver->SetShearY(m_Convolver->GetShearY());
+  m_JacobianConvolver->
+    SetNumberOfIntegrationSamples(m_Convolver->GetNumberOfIntegrationSamples());
+  m_JacobianConvolver->
+    SetWeightIntegrationByArea(m_Convolver->GetWeightIntegrationByArea());
+  m_JacobianConvolver->
+    SetUseCustomZCoordinates(m_Convolver->GetUseCustomZCoordinates());
+  m_JacobianConvolver->GetOutput()->
+    SetRequestedRegion(this->GetOutput()->GetRequestedRegion());
+
+  if (m_Convolver->GetUseCustomZCoordinates())
+    {
+    for (unsigned int k = 0; k < m_Convolver->GetSize()[ImageDimension-1]; k++)
+      {
+      m_JacobianConvolver->SetZCoordinate(k, m_Convolver->GetZCoordinate(k));
+      }
+    }
+}
+
+
 template< class TOutputImage >
 void
 BeadSpreadFunctionImageSource< TOutputImage >
@@ -487,25 +725,47 @@ BeadSpreadFunctionImageSource< TOutputImage >
 }
 
 
+template< class TOutputImage >
+typename BeadSpreadFunctionImageSource< TOutputImage >::PipelineStageType
+BeadSpreadFunctionImageSource< TOutputImage >
+::GetParameterStage(unsigned int index) const
+{
+  unsigned int numberOfBSFParameters = this->GetNumberOfBeadSpreadFunctionParameters();
+  if (index >= numberOfBSFParameters)
+    {
+    return KERNEL_STAGE;
+    }
+  else if (index == 2*ImageDimension + 3 || index == 2*ImageDimension + 4)
+    {
+    return RESCALE_STAGE;
+    }
+
+  return CONVOLUTION_STAGE;
+}
+
+
 template< class TOutputImage >
 void
 BeadSpreadFunctionImageSource< TOutputImage >
-::GenerateData()
+::ComputeKernelTableGeometry(PointType& psfTableOrigin,
+                             SpacingType& psfTableSpacing,
+                             SizeType& psfTableSize)
 {
-  // Set the PSF sampling spacing and size parameters, and update.
-  PointType   psfTableOrigin;
-  SizeType    psfTableSize;
-  SpacingType psfTableSpacing(50.0); // An arbitrary spacing
+  this->ComputeKernelTableSpacing(psfTableSpacing);
 
-  // Determine necessary spatial extent of PSF table.
-  PointType minExtent(this->GetOrigin());
+  // Determine necessary spatial extent of PSF table. Only the
+  // requested region of the output is generated.
+  const RegionType& requestedRegion = this->GetOutput()->GetRequestedRegion();
+  PointType minExtent;
   PointType maxExtent;
   const unsigned int dimensions = itkGetStaticConstMacro(OutputImageDimension);
   for ( unsigned int i = 0; i < dimensions; i++ )
     {
     // First calculate extent of BSF in this dimension.
+    minExtent[i] = static_cast<PointValueType>
+      (requestedRegion.GetIndex()[i]) * this->GetSpacing()[i] + this->GetOrigin()[i];
     maxExtent[i] = static_cast<PointValueType>
-      (this->GetSize()[i]-1) * this->GetSpacing()[i] + minExtent[i];
+      (requestedRegion.GetSize()[i]-1) * this->GetSpacing()[i] + minExtent[i];
 
     // Now modify calculated PSF dimension to account for bead shift and radius
     minExtent[i] += -GetBeadCenter()[i] - GetBeadRadius();
@@ -549,20 +809,514 @@ BeadSpreadFunctionImageSource< TOutputImage >
     psfTableSize[0] = maxRadialSize;
     psfTableSize[1] = 1;
     }
+}
+
 
+template< class TOutputImage >
+bool
+BeadSpreadFunctionImageSource< TOutputImage >
+::KernelTableCovers(const PointType& origin, const SpacingType& spacing,
+                    const SizeType& size) const
+{
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    if (spacing[i] != m_CurrentKernelTableSpacing[i])
+      {
+      return false;
+      }
+
+    // Allow for rounding in the origin computation.
+    double tolerance = 1e-6 * spacing[i];
+    double first = m_CurrentKernelTableOrigin[i];
+    double last  = first + static_cast<double>(m_CurrentKernelTableSize[i] - 1) * spacing[i];
+    double neededFirst = origin[i];
+    double neededLast  = neededFirst + static_cast<double>(size[i] - 1) * spacing[i];
+    if (neededFirst < first - tolerance || neededLast > last + tolerance)
+      {
+      return false;
+      }
+    }
+
+  return true;
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::ComputeKernelTableSpacing(SpacingType& spacing) const
+{
+  if (m_KernelTableSpacingPolicy == FIXED_KERNEL_TABLE_SPACING)
+    {
+    spacing.Fill(m_KernelTableSpacing);
+    return;
+    }
+
+  // The Nyquist spacing follows from the cutoff frequencies of the
+  // widefield OTF, 2 NA / lambda laterally and at most NA / lambda
+  // axially.
+  typedef WidefieldMicroscopePointSpreadFunctionImageSource< TOutputImage >
+    WidefieldSourceType;
+  const WidefieldSourceType* widefieldSource =
+    dynamic_cast< const WidefieldSourceType* >(m_KernelSource.GetPointer());
+
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    spacing[i] = this->GetSpacing()[i];
+    }
+
+  if (widefieldSource && widefieldSource->GetNumericalAperture() > 0.0)
+    {
+    double lambda = widefieldSource->GetEmissionWavelength();
+    double na     = widefieldSource->GetNumericalAperture();
+    spacing[0] = std::min(spacing[0], lambda / (4.0 * na));
+    spacing[1] = std::min(spacing[1], lambda / (4.0 * na));
+    spacing[2] = std::min(spacing[2], lambda / (2.0 * na));
+    }
+
+  // A radial table is sampled along x only, so keep x and y alike.
+  if (m_KernelIsRadiallySymmetric)
+    {
+    spacing[0] = spacing[1] = std::min(spacing[0], spacing[1]);
+    }
+
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    spacing[i] /= m_KernelTableOversampling;
+    }
+}
+
+
+template< class TOutputImage >
+typename BeadSpreadFunctionImageSource< TOutputImage >::RegionType
+BeadSpreadFunctionImageSource< TOutputImage >
+::ComputeKernelTableCropRegion(const OutputImageType* kernel) const
+{
+  RegionType region = kernel->GetBufferedRegion();
+  IndexType  index  = region.GetIndex();
+  SizeType   size   = region.GetSize();
+  bool radial = m_KernelIsRadiallySymmetric;
+
+  // Energy of the planes orthogonal to each dimension. Columns of a
+  // radial table stand for annuli, so they are weighted by the radius.
+  std::vector< double > planeEnergy[ImageDimension];
+  for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+    planeEnergy[d].assign(size[d], 0.0);
+    }
+
+  double totalEnergy = 0.0;
+  ImageRegionConstIteratorWithIndex< OutputImageType > it(kernel, region);
+  for (; !it.IsAtEnd(); ++it)
+    {
+    IndexType pixelIndex = it.GetIndex();
+    double energy = fabs(static_cast< double >(it.Get()));
+    if (radial)
+      {
+      energy *= static_cast< double >(pixelIndex[0] - index[0]) + 0.5;
+      }
+    totalEnergy += energy;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+      planeEnergy[d][pixelIndex[d] - index[d]] += energy;
+      }
+    }
+
+  // Peel the face plane of least energy while the energy removed,
+  // bounded by the sum of the plane energies, stays within tolerance.
+  double budget = m_KernelTableEnergyTolerance * totalEnergy;
+  double removed = 0.0;
+  long lower[ImageDimension];
+  long upper[ImageDimension];
+  for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+    lower[d] = 0;
+    upper[d] = static_cast< long >(size[d]) - 1;
+    }
+
+  while (true)
+    {
+    int bestDimension = -1;
+    bool bestUpper = false;
+    double bestEnergy = 0.0;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+      if (upper[d] <= lower[d])
+        {
+        continue;
+        }
+      if (!radial || d != 0)
+        {
+        double energy = planeEnergy[d][lower[d]];
+        if (bestDimension < 0 || energy < bestEnergy)
+          {
+          bestDimension = d;
+          bestUpper = false;
+          bestEnergy = energy;
+          }
+        }
+      double energy = planeEnergy[d][upper[d]];
+      if (bestDimension < 0 || energy < bestEnergy)
+        {
+        bestDimension = d;
+        bestUpper = true;
+        bestEnergy = energy;
+        }
+      }
+
+    if (bestDimension < 0 || removed + bestEnergy > budget)
+      {
+      break;
+      }
+
+    removed += bestEnergy;
+    if (bestUpper)
+      {
+      upper[bestDimension]--;
+      }
+    else
+      {
+      lower[bestDimension]++;
+      }
+    }
+
+  for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+    index[d] += lower[d];
+    size[d] = static_cast< SizeValueType >(upper[d] - lower[d] + 1);
+    }
+  region.SetIndex(index);
+  region.SetSize(size);
+
+  return region;
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::GenerateData()
+{
+  // The cache is keyed by the kernel parameters and table geometry
+  // only, so a change to any other setting of the kernel source
+  // invalidates every cached kernel.
+  if (m_KernelSource->GetMTime() != m_KernelSettingsMTime)
+    {
+    m_KernelCache.clear();
+    m_KernelCacheSize = 0;
+    m_KernelSettingsMTime = m_KernelSource->GetMTime();
+    }
+
+  // Set the PSF sampling spacing and size parameters.
+  PointType   psfTableOrigin;
+  SpacingType psfTableSpacing;
+  SizeType    psfTableSize;
+  this->ComputeKernelTableGeometry(psfTableOrigin, psfTableSpacing, psfTableSize);
+
+  // Reuse the current table if the kernel is unchanged and the table
+  // covers the extent needed. Otherwise pad the new table by the
+  // margin so that small moves of the bead center fit in it.
+  bool reuseTable = !m_KernelKey.empty() &&
+    m_KernelSource->GetMTime() == m_KernelSourceMTime &&
+    this->KernelTableCovers(psfTableOrigin, psfTableSpacing, psfTableSize) &&
+    this->MakeKernelCacheKey(m_CurrentKernelTableOrigin,
+                             m_CurrentKernelTableSpacing,
+                             m_CurrentKernelTableSize) == m_KernelKey;
+  if (reuseTable)
+    {
+    psfTableOrigin = m_CurrentKernelTableOrigin;
+    psfTableSize   = m_CurrentKernelTableSize;
+    }
+  else if (m_KernelTableMargin > 0.0)
+    {
+    for (unsigned int i = 0; i < ImageDimension; i++)
+      {
+      if (psfTableSize[i] == 1 && m_KernelIsRadiallySymmetric)
+        {
+        continue;
+        }
+      long margin = Math::Ceil<long>(m_KernelTableMargin / psfTableSpacing[i]);
+      if (!m_KernelIsRadiallySymmetric || i == 2)
+        {
+        psfTableOrigin[i] -= static_cast<double>(margin) * psfTableSpacing[i];
+        psfTableSize[i] += margin;
+        }
+      psfTableSize[i] += margin;
+      }
+    }
+  m_CurrentKernelTableOrigin  = psfTableOrigin;
+  m_CurrentKernelTableSpacing = psfTableSpacing;
+  m_CurrentKernelTableSize    = psfTableSize;
+
+  unsigned long kernelMTime = m_KernelSource->GetMTime();
   m_KernelSource->SetSize(psfTableSize);
   m_KernelSource->SetSpacing(psfTableSpacing);
   m_KernelSource->SetOrigin(psfTableOrigin);
+  this->KernelSourceChanged(kernelMTime);
+
+  // Kernel stage. The kernel table is current if neither the kernel
+  // parameters, the table geometry, nor any other setting of the
+  // kernel source changed since it was last produced.
+  KernelCacheKeyType key =
+    this->MakeKernelCacheKey(psfTableOrigin, psfTableSpacing, psfTableSize);
+  bool kernelChanged = key != m_KernelKey ||
+    m_KernelSource->GetMTime() != m_KernelSourceMTime;
+
+  bool addToCache = false;
+  if (kernelChanged)
+    {
+    addToCache = this->UpdateKernel(key);
+    m_KernelKey = key;
+    m_KernelSourceMTime = m_KernelSource->GetMTime();
+    m_NumberOfKernelUpdates++;
+    }
+
+  // Convolution stage. The convolver is modified by changes to the
+  // bead geometry, the output image geometry, or its inputs. It
+  // applies the intensity shift and scale as it writes its output,
+  // and computes only the requested region.
+  typename OutputImageType::Pointer convolverOutput = m_Convolver->GetOutput();
+  const RegionType& requestedRegion = this->GetOutput()->GetRequestedRegion();
+  bool convolve = kernelChanged ||
+    m_Convolver->GetMTime() > convolverOutput->GetUpdateMTime() ||
+    !convolverOutput->GetBufferedRegion().IsInside(requestedRegion);
+
+  // Rescale stage. If only the shift and scale changed, the output is
+  // rescaled in place, which needs the previous scale to be nonzero.
+  bool rescale = m_IntensityShift != m_AppliedIntensityShift ||
+    m_IntensityScale != m_AppliedIntensityScale;
+  if (!convolve && rescale && m_AppliedIntensityScale == 0.0)
+    {
+    convolve = true;
+    }
+
+  if (convolve)
+    {
+    m_Convolver->SetOutputShift(m_IntensityShift);
+    m_Convolver->SetOutputScale(m_IntensityScale);
+
+    unsigned long updateTime = convolverOutput->GetUpdateMTime();
+    convolverOutput->SetRequestedRegion(requestedRegion);
+    m_Convolver->Update();
+    if (convolverOutput->GetUpdateMTime() != updateTime)
+      {
+      m_NumberOfConvolutionUpdates++;
+      }
+    }
+  else if (rescale)
+    {
+    double scale = m_IntensityScale / m_AppliedIntensityScale;
+    double shift = m_IntensityShift - scale * m_AppliedIntensityShift;
+    ImageRegionIterator< OutputImageType >
+      it(convolverOutput, convolverOutput->GetBufferedRegion());
+    for (; !it.IsAtEnd(); ++it)
+      {
+      it.Set( static_cast< PixelType >(shift + scale * it.Get()) );
+      }
+    }
+  m_AppliedIntensityShift = m_IntensityShift;
+  m_AppliedIntensityScale = m_IntensityScale;
+
+  // The scan of a newly generated kernel is available once the
+  // convolver has run.
+  if (addToCache)
+    {
+    this->AddKernelCacheEntry(key);
+    }
+
+  this->GraftOutput(convolverOutput);
+}
+
+
+template< class TOutputImage >
+bool
+BeadSpreadFunctionImageSource< TOutputImage >
+::UpdateKernel(const KernelCacheKeyType& key)
+{
+  // Look up the kernel table and its scan in the cache.
+  typename KernelCacheType::iterator entry = m_KernelCache.end();
+  if (m_KernelCacheMaximumSize > 0)
+    {
+    for (entry = m_KernelCache.begin(); entry != m_KernelCache.end(); ++entry)
+      {
+      if (entry->key == key)
+        {
+        break;
+        }
+      }
+    }
+
+  if (entry != m_KernelCache.end())
+    {
+    // Move the entry to the front of the list.
+    m_KernelCache.splice(m_KernelCache.begin(), m_KernelCache, entry);
+    m_KernelCacheHits++;
+
+    m_Convolver->SetInput(entry->kernel);
+    m_Convolver->SetScannedKernel(entry->scannedKernel);
+    return false;
+    }
+
   m_KernelSource->UpdateLargestPossibleRegion();
 
-  m_Convolver->SetInput(m_KernelSource->GetOutput());
-  m_Convolver->UpdateLargestPossibleRegion();
+  // Crop the low-energy margins of the table.
+  OutputImagePointer kernel = m_KernelSource->GetOutput();
+  if (m_KernelTableEnergyTolerance > 0.0)
+    {
+    typedef RegionOfInterestImageFilter< OutputImageType, OutputImageType >
+      CropFilterType;
+    typename CropFilterType::Pointer cropFilter = CropFilterType::New();
+    cropFilter->SetInput(kernel);
+    cropFilter->SetRegionOfInterest(this->ComputeKernelTableCropRegion(kernel));
+    cropFilter->Update();
+    kernel = cropFilter->GetOutput();
+    kernel->DisconnectPipeline();
+    }
+
+  m_Convolver->SetInput(kernel);
+  m_Convolver->SetScannedKernel(NULL);
+
+  if (m_KernelCacheMaximumSize > 0)
+    {
+    m_KernelCacheMisses++;
+    return true;
+    }
+
+  return false;
+}
+
 
-  m_RescaleFilter->GraftOutput(this->GetOutput());
-  m_RescaleFilter->SetShift(m_IntensityShift);
-  m_RescaleFilter->SetScale(m_IntensityScale);
-  m_RescaleFilter->UpdateLargestPossibleRegion();
-  this->GraftOutput(m_RescaleFilter->GetOutput());
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::KernelSourceChanged(unsigned long previousMTime)
+{
+  // Changes made here are covered by the cache key, unless another
+  // setting changed since the cache was last validated.
+  if (previousMTime == m_KernelSettingsMTime)
+    {
+    m_KernelSettingsMTime = m_KernelSource->GetMTime();
+    }
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::SetKernelCacheMaximumSize(unsigned long size)
+{
+  m_KernelCacheMaximumSize = size;
+  this->TrimKernelCache();
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::ClearKernelCache()
+{
+  m_KernelCache.clear();
+  m_KernelCacheSize = 0;
+
+  // The convolver may refer to a cached kernel. Force the kernel to
+  // be regenerated in the next update.
+  m_Convolver->SetScannedKernel(NULL);
+  m_KernelKey.clear();
+  this->Modified();
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::ResetKernelCacheStatistics()
+{
+  m_KernelCacheHits   = 0;
+  m_KernelCacheMisses = 0;
+}
+
+
+template< class TOutputImage >
+typename BeadSpreadFunctionImageSource< TOutputImage >::KernelCacheKeyType
+BeadSpreadFunctionImageSource< TOutputImage >
+::MakeKernelCacheKey(const PointType& origin, const SpacingType& spacing,
+                     const SizeType& size) const
+{
+  ParametersType kernelParameters = m_KernelSource->GetParameters();
+
+  KernelCacheKeyType key;
+  key.reserve(kernelParameters.GetSize() + 3*ImageDimension + 2);
+  for (unsigned int i = 0; i < kernelParameters.GetSize(); i++)
+    {
+    key.push_back(kernelParameters[i]);
+    }
+
+  // The spacing policy and energy tolerance determine how the table
+  // is sampled and cropped.
+  key.push_back(static_cast<double>(m_KernelTableSpacingPolicy));
+  key.push_back(m_KernelTableEnergyTolerance);
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    key.push_back(origin[i]);
+    key.push_back(spacing[i]);
+    key.push_back(static_cast<double>(size[i]));
+    }
+
+  return key;
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::AddKernelCacheEntry(const KernelCacheKeyType& key)
+{
+  typedef ImageDuplicator< OutputImageType > DuplicatorType;
+
+  KernelCacheEntry entry;
+  entry.key = key;
+
+  typename DuplicatorType::Pointer kernelDuplicator = DuplicatorType::New();
+  kernelDuplicator->SetInputImage(m_Convolver->GetInput());
+  kernelDuplicator->Update();
+  entry.kernel = kernelDuplicator->GetOutput();
+
+  // The FFT method does not scan the kernel, and the chord method
+  // scans only the kernel columns needed for the requested region. A
+  // null scan makes the chord method compute it when the entry is
+  // used.
+  unsigned long images = 1;
+  OutputImageType* scan = m_Convolver->GetScannedKernel();
+  if (m_Convolver->GetConvolutionMethod() == ConvolverType::CHORD_CONVOLUTION &&
+      scan->GetBufferedRegion() == scan->GetLargestPossibleRegion())
+    {
+    typename DuplicatorType::Pointer scanDuplicator = DuplicatorType::New();
+    scanDuplicator->SetInputImage(scan);
+    scanDuplicator->Update();
+    entry.scannedKernel = scanDuplicator->GetOutput();
+    images = 2;
+    }
+
+  entry.size = images * sizeof(PixelType) *
+    entry.kernel->GetLargestPossibleRegion().GetNumberOfPixels();
+
+  m_KernelCache.push_front(entry);
+  m_KernelCacheSize += entry.size;
+
+  this->TrimKernelCache();
+}
+
+
+template< class TOutputImage >
+void
+BeadSpreadFunctionImageSource< TOutputImage >
+::TrimKernelCache()
+{
+  while (!m_KernelCache.empty() && m_KernelCacheSize > m_KernelCacheMaximumSize)
+    {
+    m_KernelCacheSize -= m_KernelCache.back().size;
+    m_KernelCache.pop_back();
+    }
 }
 
 
@@ -593,9 +1347,23 @@ BeadSpreadFunctionImageSource< TOutputImage >
 ::PrintSelf(std::ostream& os, Indent indent) const
 {
   Superclass::PrintSelf(os,indent);
+  os << indent << "KernelTableSpacingPolicy: "
+     << (m_KernelTableSpacingPolicy == FIXED_KERNEL_TABLE_SPACING ? "Fixed" : "Adaptive")
+     << std::endl;
+  os << indent << "KernelTableSpacing: " << m_KernelTableSpacing << std::endl;
+  os << indent << "KernelTableOversampling: " << m_KernelTableOversampling << std::endl;
+  os << indent << "KernelTableEnergyTolerance: " << m_KernelTableEnergyTolerance
+     << std::endl;
+  os << indent << "KernelTableMargin: " << m_KernelTableMargin << std::endl;
+  os << indent << "KernelCacheMaximumSize: " << m_KernelCacheMaximumSize << std::endl;
+  os << indent << "KernelCacheSize: " << m_KernelCacheSize << std::endl;
+  os << indent << "KernelCacheHits: " << m_KernelCacheHits << std::endl;
+  os << indent << "KernelCacheMisses: " << m_KernelCacheMisses << std::endl;
+  os << indent << "NumberOfKernelUpdates: " << m_NumberOfKernelUpdates << std::endl;
+  os << indent << "NumberOfConvolutionUpdates: " << m_NumberOfConvolutionUpdates
+     << std::endl;
   m_KernelSource->Print(os,indent);
   m_Convolver->Print(os,indent);
-  m_RescaleFilter->Print(os,indent);
 }
 
 
@@ -0,0 +1,150 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkBesselSeriesGibsonLanniPointSpreadFunctionImageSource_h
+#define __itkBesselSeriesGibsonLanniPointSpreadFunctionImageSource_h
+
+#include <vector>
+
+#include "itkGibsonLanniPointSpreadFunctionImageSource.h"
+#include "vnl/vnl_matrix.h"
+
+namespace itk
+{
+
+/** \class BesselSeriesGibsonLanniPointSpreadFunctionImageSource
+ * \brief Generate a synthetic point-spread function according to the
+ * Gibson-Lanni model by expanding the phase term in Bessel functions.
+ *
+ * For each defocus z, the phase term exp(i*k*OPD(rho, z)) of the
+ * Gibson-Lanni integrand is approximated by a least-squares fit of the
+ * series sum_m c_m(z) J0(s_m rho) with scale factors s_m = 3m - 2,
+ * m = 1..M. The radial integral against J0(b rho) rho then has the
+ * closed form
+ *
+ *   sum_m c_m(z) (s_m J1(s_m) J0(b) - b J0(s_m) J1(b)) / (s_m^2 - b^2),
+ *
+ * so each sample costs one evaluation of J0 and J1 and a sum of M
+ * terms instead of a quadrature over the aperture. The least-squares
+ * fit matrix depends only on M and is computed once with an SVD; the
+ * coefficients are computed once per z-plane of the requested region.
+ *
+ * The parameters are identical to those of
+ * GibsonLanniPointSpreadFunctionImageSource, so this class can be
+ * used wherever that class is used, e.g., as the kernel source of a
+ * BeadSpreadFunctionImageSource. The series replaces the per-sample
+ * quadrature in both the per-voxel and the quadrature radial profile
+ * paths; the matrix product radial profile method is unaffected.
+ *
+ * \ingroup DataSources Multithreaded
+ */
+template< class TOutputImage >
+class ITK_EXPORT BesselSeriesGibsonLanniPointSpreadFunctionImageSource :
+  public GibsonLanniPointSpreadFunctionImageSource< TOutputImage >
+{
+public:
+  /** Standard class typedefs. */
+  typedef BesselSeriesGibsonLanniPointSpreadFunctionImageSource     Self;
+  typedef GibsonLanniPointSpreadFunctionImageSource< TOutputImage > Superclass;
+  typedef SmartPointer< Self >                                      Pointer;
+  typedef SmartPointer< const Self >                                ConstPointer;
+
+  /** Typedef for the output image PixelType. */
+  typedef TOutputImage                             OutputImageType;
+  typedef typename OutputImageType::PixelType      PixelType;
+  typedef typename OutputImageType::IndexType      IndexType;
+  typedef typename OutputImageType::RegionType     RegionType;
+  typedef typename OutputImageType::PointType      PointType;
+  typedef typename OutputImageType::SizeValueType  SizeValueType;
+
+  typedef typename Superclass::ComplexType ComplexType;
+  typedef typename Superclass::FunctorType FunctorType;
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(BesselSeriesGibsonLanniPointSpreadFunctionImageSource,
+               GibsonLanniPointSpreadFunctionImageSource);
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Set/get the number M of Bessel functions in the series. More
+   * terms are needed the farther the output extends from focus. With
+   * the default of 100, the error is below 1e-5 of the peak intensity
+   * within 10 micrometers of focus at NA 1.4. At least one term is
+   * used. */
+  itkSetClampMacro(NumberOfBasisFunctions, unsigned int,
+                   1, NumericTraits<unsigned int>::max());
+  itkGetConstMacro(NumberOfBasisFunctions, unsigned int);
+
+protected:
+  BesselSeriesGibsonLanniPointSpreadFunctionImageSource();
+  ~BesselSeriesGibsonLanniPointSpreadFunctionImageSource();
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  void BeforeThreadedGenerateData();
+
+  /** The series evaluation reads only the fitting functor, so the
+   * superclass builds its integrand tables only when the matrix
+   * product or derivative paths need them. */
+  virtual bool ComputesSamplesFromIntegrand() const { return false; }
+
+  /** Computes the light intensity at radial distance r from the
+   * optical axis in detector coordinates and defocus z, both in
+   * meters, from the series. */
+  virtual double ComputeRadialSampleValue(double r, double z, int threadId,
+                                          unsigned long& evaluations);
+
+  /** Computes the least-squares fit matrix and the basis values
+   * needed by the closed-form integrals. */
+  void ComputeFitMatrix();
+
+  /** Computes the series coefficients of the phase term at defocus z
+   * in meters. */
+  void ComputeSeriesCoefficients(double z, ComplexType* coefficients) const;
+
+private:
+  BesselSeriesGibsonLanniPointSpreadFunctionImageSource(const BesselSeriesGibsonLanniPointSpreadFunctionImageSource&); //purposely not implemented
+  void operator=(const BesselSeriesGibsonLanniPointSpreadFunctionImageSource&); //purposely not implemented
+
+  unsigned int m_NumberOfBasisFunctions;
+
+  /** Functor holding the OPD terms at the fitting nodes. */
+  FunctorType m_FitFunctor;
+
+  /** Pseudo-inverse of the basis matrix, with one row per basis
+   * function and one column per fitting node. */
+  vnl_matrix<double> m_FitMatrix;
+
+  /** Scale factor s_m of each basis function and the values
+   * s_m J1(s_m), J0(s_m) and s_m^2 used in the closed-form
+   * integrals. */
+  std::vector<double> m_BasisScale;
+  std::vector<double> m_BasisScaleJ1;
+  std::vector<double> m_BasisJ0;
+  std::vector<double> m_BasisScaleSquared;
+
+  /** Series coefficients for each z-plane of the requested region. */
+  std::vector<double>      m_SliceZ;
+  std::vector<ComplexType> m_SliceCoefficients;
+};
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkBesselSeriesGibsonLanniPointSpreadFunctionImageSource.txx"
+#endif
+
+#endif
@@ -0,0 +1,224 @@
+#ifndef __itkBesselSeriesGibsonLanniPointSpreadFunctionImageSource_txx
+#define __itkBesselSeriesGibsonLanniPointSpreadFunctionImageSource_txx
+
+#include "itkBesselSeriesGibsonLanniPointSpreadFunctionImageSource.h"
+#include "itkMath.h"
+#include "vnl/algo/vnl_svd.h"
+
+namespace itk
+{
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::BesselSeriesGibsonLanniPointSpreadFunctionImageSource()
+{
+  this->m_NumberOfBasisFunctions = 100;
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::~BesselSeriesGibsonLanniPointSpreadFunctionImageSource()
+{
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os,indent);
+
+  os << indent << "NumberOfBasisFunctions: " << m_NumberOfBasisFunctions
+     << std::endl;
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource< TOutputImage >
+::BeforeThreadedGenerateData()
+{
+  Superclass::BeforeThreadedGenerateData();
+
+  // The matrix product and derivative paths do not use the series.
+  if ((this->m_UseRadialProfile &&
+       this->m_RadialProfileMethod == Superclass::MATRIX_PRODUCT_PROFILE) ||
+      !this->m_JacobianParameters.empty())
+    {
+    return;
+    }
+
+  // The fit matrix depends only on the number of basis functions.
+  if (m_BasisScale.size() != m_NumberOfBasisFunctions)
+    {
+    this->ComputeFitMatrix();
+    }
+
+  // Tabulate the OPD terms at the fitting nodes.
+  m_FitFunctor.CopySettings(this);
+  m_FitFunctor.PrecomputeOPDTable(0.0, 1.0, (m_FitMatrix.cols() - 1) / 2);
+
+  // Fit the phase term once for each z-plane of the requested region.
+  RegionType region = this->GetOutput(0)->GetRequestedRegion();
+  SizeValueType numberOfSlices = region.GetSize()[2];
+
+  m_SliceZ.resize(numberOfSlices);
+  m_SliceCoefficients.resize(numberOfSlices * m_NumberOfBasisFunctions);
+  for (SizeValueType k = 0; k < numberOfSlices; k++)
+    {
+    RegionType sliceRegion;
+    double maxRadius, z;
+    this->GetSliceExtent(region, k, sliceRegion, maxRadius, z);
+
+    m_SliceZ[k] = z * 1e-9;
+    this->ComputeSeriesCoefficients
+      (m_SliceZ[k], &m_SliceCoefficients[k * m_NumberOfBasisFunctions]);
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+double
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeRadialSampleValue(double r, double z, int itkNotUsed(threadId),
+                           unsigned long& itkNotUsed(evaluations))
+{
+  unsigned int M = m_NumberOfBasisFunctions;
+
+  // Look up the coefficients of the z-plane, falling back to fitting
+  // them here for a z outside the requested region.
+  const ComplexType* coefficients = 0;
+  std::vector<ComplexType> localCoefficients;
+
+  SizeValueType numberOfSlices = m_SliceZ.size();
+  if (numberOfSlices > 0)
+    {
+    double dz = numberOfSlices > 1 ? m_SliceZ[1] - m_SliceZ[0] : 0.0;
+    long k = 0;
+    if (dz != 0.0)
+      {
+      k = Math::Round<long>((z - m_SliceZ[0]) / dz);
+      }
+    if (k >= 0 && k < static_cast<long>(numberOfSlices) &&
+        fabs(m_SliceZ[k] - z) <= 1e-12)
+      {
+      coefficients = &m_SliceCoefficients[k * M];
+      }
+    }
+
+  if (!coefficients)
+    {
+    localCoefficients.resize(M);
+    this->ComputeSeriesCoefficients(z, &localCoefficients[0]);
+    coefficients = &localCoefficients[0];
+    }
+
+  const FunctorType& functor = m_FitFunctor;
+  double b  = functor.m_K * functor.m_A * r / (0.160 + z);
+  double b2 = b * b;
+  double j0b = j0(b);
+  double bj1b = b * j1(b);
+
+  ComplexType sum(0.0, 0.0);
+  for (unsigned int m = 0; m < M; m++)
+    {
+    // Integral of J0(b rho) J0(s_m rho) rho over [0,1], using its
+    // limit as b approaches s_m when the closed form is ill-conditioned.
+    double integral;
+    double denominator = m_BasisScaleSquared[m] - b2;
+    if (fabs(b - m_BasisScale[m]) < 1e-6 * m_BasisScale[m])
+      {
+      integral = 0.5 * (m_BasisJ0[m]*m_BasisJ0[m] +
+                        m_BasisScaleJ1[m]*m_BasisScaleJ1[m] / m_BasisScaleSquared[m]);
+      }
+    else
+      {
+      integral = (m_BasisScaleJ1[m] * j0b - m_BasisJ0[m] * bj1b) / denominator;
+      }
+
+    sum += coefficients[m] * integral;
+    }
+
+  return static_cast<PixelType>(norm(sum));
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeFitMatrix()
+{
+  unsigned int M = m_NumberOfBasisFunctions;
+
+  // Fit at about three uniformly spaced nodes per basis function. The
+  // node count is odd to match the layout of the OPD table.
+  unsigned int numberOfNodes = 2 * ((3*M + 1) / 2) + 1;
+
+  m_BasisScale.resize(M);
+  m_BasisScaleJ1.resize(M);
+  m_BasisJ0.resize(M);
+  m_BasisScaleSquared.resize(M);
+  for (unsigned int m = 0; m < M; m++)
+    {
+    double s = static_cast<double>(3*(m+1) - 2);
+    m_BasisScale[m]        = s;
+    m_BasisScaleJ1[m]      = s * j1(s);
+    m_BasisJ0[m]           = j0(s);
+    m_BasisScaleSquared[m] = s * s;
+    }
+
+  vnl_matrix<double> basis(numberOfNodes, M);
+  for (unsigned int i = 0; i < numberOfNodes; i++)
+    {
+    double rho = static_cast<double>(i) / static_cast<double>(numberOfNodes - 1);
+    for (unsigned int m = 0; m < M; m++)
+      {
+      basis(i, m) = j0(m_BasisScale[m] * rho);
+      }
+    }
+
+  vnl_svd<double> svd(basis);
+  m_FitMatrix = svd.pinverse();
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+BesselSeriesGibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeSeriesCoefficients(double z, ComplexType* coefficients) const
+{
+  const FunctorType& functor = m_FitFunctor;
+  unsigned int numberOfNodes = m_FitMatrix.cols();
+
+  std::vector<ComplexType> phase(numberOfNodes);
+  for (unsigned int i = 0; i < numberOfNodes; i++)
+    {
+    ComplexType opd = functor.m_OPDConstantTable[i] +
+      z * functor.m_OPDDefocusTable[i];
+    phase[i] = exp(ComplexType(0.0, 1.0) * opd * functor.m_K);
+    }
+
+  for (unsigned int m = 0; m < m_NumberOfBasisFunctions; m++)
+    {
+    const double* row = m_FitMatrix[m];
+    ComplexType sum(0.0, 0.0);
+    for (unsigned int i = 0; i < numberOfNodes; i++)
+      {
+      sum += row[i] * phase[i];
+      }
+    coefficients[m] = sum;
+    }
+}
+
+} // end namespace itk
+
+#endif
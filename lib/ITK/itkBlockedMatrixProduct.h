@@ -0,0 +1,73 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkBlockedMatrixProduct_h
+#define __itkBlockedMatrixProduct_h
+
+namespace itk
+{
+
+/** Computes the matrix product C = A * B, where A is M x K, B is K x N
+ * and C is M x N, all stored in row-major order. The loops are tiled
+ * so that a blockSize x blockSize tile of each operand stays in cache
+ * while it is used, and the innermost loop runs over contiguous
+ * elements of B and C so that the compiler can vectorize it.
+ *
+ * Complex right-hand sides can be multiplied by a real A by storing
+ * the real and imaginary parts of each element of B in adjacent
+ * columns.
+ */
+template< class TReal >
+void BlockedMatrixProduct(const TReal* A, const TReal* B, TReal* C,
+                          unsigned int M, unsigned int K, unsigned int N,
+                          unsigned int blockSize = 64)
+{
+  for (unsigned int i = 0; i < M*N; i++)
+    {
+    C[i] = static_cast<TReal>(0);
+    }
+
+  for (unsigned int ii = 0; ii < M; ii += blockSize)
+    {
+    unsigned int iEnd = ii + blockSize < M ? ii + blockSize : M;
+    for (unsigned int kk = 0; kk < K; kk += blockSize)
+      {
+      unsigned int kEnd = kk + blockSize < K ? kk + blockSize : K;
+      for (unsigned int jj = 0; jj < N; jj += blockSize)
+        {
+        unsigned int jEnd = jj + blockSize < N ? jj + blockSize : N;
+        for (unsigned int i = ii; i < iEnd; i++)
+          {
+          TReal* cRow = C + i*N;
+          for (unsigned int k = kk; k < kEnd; k++)
+            {
+            const TReal  a    = A[i*K + k];
+            const TReal* bRow = B + k*N;
+            for (unsigned int j = jj; j < jEnd; j++)
+              {
+              cRow[j] += a * bRow[j];
+              }
+            }
+          }
+        }
+      }
+    }
+}
+
+} // end namespace itk
+
+#endif // __itkBlockedMatrixProduct_h
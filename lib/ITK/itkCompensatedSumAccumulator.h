@@ -0,0 +1,79 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkCompensatedSumAccumulator_h
+#define __itkCompensatedSumAccumulator_h
+
+#include "itkNumericTraits.h"
+#include "vnl/vnl_math.h"
+
+namespace itk
+{
+namespace Function
+{
+
+/** \class CompensatedSumAccumulator
+ * \brief Sums its inputs with compensation for the rounding error.
+ *
+ * A drop-in replacement for SumAccumulator in ScanImageFilter and
+ * ProjectionImageFilter. It keeps the rounding error of each addition
+ * in a second variable (Neumaier's variant of Kahan summation) and adds
+ * it back in GetValue(). The error of the sum then no longer grows with
+ * the number of inputs, so a scan stored as float is as accurate as
+ * the float rounding of a scan summed in double.
+ *
+ * The compensation relies on the order of the floating-point
+ * operations, so it must not be compiled with options that let the
+ * compiler reassociate them, such as -ffast-math.
+ */
+template <class TInputPixel, class TOutputPixel>
+class CompensatedSumAccumulator
+{
+public:
+  CompensatedSumAccumulator( unsigned long ) {}
+  ~CompensatedSumAccumulator() {}
+
+  inline void Initialize()
+  {
+    m_Sum          = NumericTraits< TOutputPixel >::Zero;
+    m_Compensation = NumericTraits< TOutputPixel >::Zero;
+  }
+
+  inline void operator()( const TInputPixel & input )
+  {
+    TOutputPixel value = static_cast< TOutputPixel >( input );
+    TOutputPixel sum   = m_Sum + value;
+
+    // Recover the low-order bits lost from the smaller operand.
+    bool sumIsLarger = vnl_math_abs( m_Sum ) >= vnl_math_abs( value );
+    m_Compensation += sumIsLarger ? (m_Sum - sum) + value : (value - sum) + m_Sum;
+    m_Sum = sum;
+  }
+
+  inline TOutputPixel GetValue()
+  {
+    return m_Sum + m_Compensation;
+  }
+
+  TOutputPixel m_Sum;
+  TOutputPixel m_Compensation;
+};
+
+} // end namespace Function
+} // end namespace itk
+
+#endif // __itkCompensatedSumAccumulator_h
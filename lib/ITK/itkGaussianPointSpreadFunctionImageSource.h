@@ -72,6 +72,8 @@ public:
 
   typedef double                       ParametersValueType;
   typedef Array< ParametersValueType > ParametersType;
+  typedef typename Superclass::ParametersMaskType ParametersMaskType;
+  typedef typename Superclass::JacobianType       JacobianType;
 
   void SetSigma(const ArrayType& sigma);
   const ArrayType& GetSigma() const;
@@ -86,6 +88,11 @@ public:
   ParametersType GetParameters() const;
   unsigned int   GetNumberOfParameters() const;
 
+  /** Generates the output image and its analytic derivatives with
+   * respect to the standard deviations. */
+  virtual void GenerateJacobian(const ParametersMaskType& mask,
+                                JacobianType& jacobian);
+
 protected:
   GaussianPointSpreadFunctionImageSource();
   ~GaussianPointSpreadFunctionImageSource();
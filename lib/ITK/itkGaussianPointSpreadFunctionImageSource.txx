@@ -19,6 +19,8 @@
 #define __itkGaussianPointSpreadFunctionImageSource_txx
 
 #include "itkGaussianPointSpreadFunctionImageSource.h"
+#include "itkImageRegionConstIteratorWithIndex.h"
+#include "itkImageRegionIterator.h"
 
 namespace itk
 {
@@ -175,6 +177,63 @@ GaussianPointSpreadFunctionImageSource<TOutputImage>
 }
 
 
+template<typename TOutputImage>
+void
+GaussianPointSpreadFunctionImageSource<TOutputImage>
+::GenerateJacobian(const ParametersMaskType& mask, JacobianType& jacobian)
+{
+  this->UpdateLargestPossibleRegion();
+
+  const unsigned int dimensions = itkGetStaticConstMacro(OutputImageDimension);
+  jacobian.assign(this->GetNumberOfParameters(), typename Superclass::OutputImagePointer());
+
+  typedef ImageRegionIterator< OutputImageType > JacobianIteratorType;
+  std::vector< JacobianIteratorType > jacobianIterators(dimensions);
+  for (unsigned int i = 0; i < dimensions; i++)
+    {
+    if (mask[i])
+      {
+      jacobian[i] = this->NewJacobianImage();
+      jacobianIterators[i] =
+        JacobianIteratorType(jacobian[i], jacobian[i]->GetLargestPossibleRegion());
+      }
+    }
+
+  // With G = s * exp(-sum_i (x_i - m_i)^2 / (2 sigma_i^2)), the
+  // derivative with respect to sigma_i is G * (x_i - m_i)^2 / sigma_i^3.
+  // The normalization factor of a normalized Gaussian contributes
+  // -G / sigma_i.
+  const ArrayType& sigma = this->GetSigma();
+  const ArrayType& mean  = this->GetMean();
+  bool normalized = this->m_GaussianImageSource->GetNormalized();
+
+  OutputImageType* output = this->GetOutput();
+  ImageRegionConstIteratorWithIndex< OutputImageType >
+    it(output, output->GetLargestPossibleRegion());
+  PointType point;
+  for (; !it.IsAtEnd(); ++it)
+    {
+    output->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+    double value = it.Get();
+    for (unsigned int i = 0; i < dimensions; i++)
+      {
+      if (!mask[i])
+        {
+        continue;
+        }
+      double d = point[i] - mean[i];
+      double derivative = value * d * d / (sigma[i] * sigma[i] * sigma[i]);
+      if (normalized)
+        {
+        derivative -= value / sigma[i];
+        }
+      jacobianIterators[i].Set( static_cast<OutputImagePixelType>(derivative) );
+      ++jacobianIterators[i];
+      }
+    }
+}
+
+
 template <class TOutputImage>
 void
 GaussianPointSpreadFunctionImageSource<TOutputImage>
@@ -303,6 +303,13 @@ public:
   void SetUseCustomZCoordinates(bool use);
   bool GetUseCustomZCoordinates();
 
+  /** Get the tile scheduler of the sphere convolution, for its
+   * per-thread statistics of the last update. */
+  typename ConvolverType::SchedulerType* GetConvolverScheduler()
+  {
+    return m_Convolver->GetScheduler();
+  }
+
 protected:
   GibsonLanniBSFImageSource();
   ~GibsonLanniBSFImageSource();
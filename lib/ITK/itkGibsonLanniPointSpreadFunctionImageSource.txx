@@ -21,10 +21,11 @@
 #define __itkGibsonLanniPointSpreadFunctionImageSource_txx
 
 #include "itkGibsonLanniPointSpreadFunctionImageSource.h"
+#include "itkBlockedMatrixProduct.h"
+#include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
 #include "itkMath.h"
 #include "itkObjectFactory.h"
-#include "itkProgressReporter.h"
 
 namespace itk
 {
@@ -54,6 +55,16 @@ GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
   this->m_DesignSpecimenLayerRefractiveIndex         =  1.33; // unitless
   this->m_ActualSpecimenLayerRefractiveIndex         =  1.33; // unitless
   this->m_ActualPointSourceDepthInSpecimenLayer      =   0.0; // in micrometers
+
+  this->m_UseRadialProfile               = false;
+  this->m_RadialProfileSubsamplingFactor = 8;
+  this->m_RadialProfileMethod            = QUADRATURE_PROFILE;
+  this->m_BesselMatrixRows               = 0;
+  this->m_ScaledRadiusSpacing            = 0.0;
+  this->m_BesselJ0MaximumError           = 1e-8;
+  this->m_IntegrandPrecision             = DOUBLE_PRECISION;
+  this->m_Jacobian                       = NULL;
+  this->m_Scheduler                      = SchedulerType::New();
 }
 
 
@@ -259,6 +270,62 @@ GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
 }
 
 
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::GenerateJacobian(const ParametersMaskType& mask, JacobianType& jacobian)
+{
+  // The analytic derivatives are those of the per-voxel quadrature at
+  // the tabulated nodes. Differentiate the value path by central
+  // differences when it samples the integral another way, so that the
+  // derivatives match the intensities being fitted.
+  if (this->m_UseRadialProfile ||
+      this->m_IntegrationRelativeTolerance > 0.0 ||
+      this->m_IntegrandPrecision == SINGLE_PRECISION ||
+      !this->ComputesSamplesFromIntegrand())
+    {
+    Superclass::GenerateJacobian(mask, jacobian);
+    return;
+    }
+
+  jacobian.assign(this->GetNumberOfParameters(),
+                  typename Superclass::OutputImagePointer());
+
+  this->m_JacobianParameters.clear();
+  for (unsigned int i = 0; i < jacobian.size(); i++)
+    {
+    if (mask[i])
+      {
+      this->m_JacobianParameters.push_back(i);
+      }
+    }
+
+  if (this->m_JacobianParameters.empty())
+    {
+    this->Update();
+    return;
+    }
+
+  // Defaults the requested region to the largest possible region if
+  // it has not been set. The derivative images buffer the requested
+  // region, so only it is generated.
+  this->GetOutput()->UpdateOutputInformation();
+  for (unsigned int i = 0; i < this->m_JacobianParameters.size(); i++)
+    {
+    jacobian[this->m_JacobianParameters[i]] = this->NewJacobianImage();
+    }
+
+  // Force the output to be regenerated along with the derivatives.
+  this->m_Jacobian = &jacobian;
+  this->Modified();
+  this->Update();
+
+  this->m_Jacobian = NULL;
+  this->m_JacobianParameters.clear();
+}
+
+
 //----------------------------------------------------------------------------
 template< class TOutputImage >
 void
@@ -266,6 +333,18 @@ GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
 ::PrintSelf(std::ostream& os, Indent indent) const
 {
   Superclass::PrintSelf(os,indent);
+
+  os << indent << "UseRadialProfile: " << m_UseRadialProfile << std::endl;
+  os << indent << "RadialProfileSubsamplingFactor: "
+     << m_RadialProfileSubsamplingFactor << std::endl;
+  os << indent << "RadialProfileMethod: "
+     << (m_RadialProfileMethod == MATRIX_PRODUCT_PROFILE ?
+         "MatrixProduct" : "Quadrature") << std::endl;
+  os << indent << "BesselJ0MaximumError: " << m_BesselJ0MaximumError
+     << std::endl;
+  os << indent << "IntegrandPrecision: "
+     << (m_IntegrandPrecision == SINGLE_PRECISION ? "Single" : "Double")
+     << std::endl;
 }
 
 
@@ -275,32 +354,221 @@ void
 GibsonLanniPointSpreadFunctionImageSource< TOutputImage >
 ::BeforeThreadedGenerateData()
 {
-  this->m_IntegrandFunctor.CopySettings(this);
+  Superclass::BeforeThreadedGenerateData();
+
+  // The matrix product method always evaluates the integrand at the
+  // tabulated quadrature nodes.
+  bool useMatrixProduct = this->m_UseRadialProfile &&
+    this->m_RadialProfileMethod == MATRIX_PRODUCT_PROFILE;
+
+  // So do the derivatives.
+  bool generateJacobian = !this->m_JacobianParameters.empty();
+
+  if (useMatrixProduct || generateJacobian ||
+      this->ComputesSamplesFromIntegrand())
+    {
+    this->InitializeIntegrandFunctor
+      (this->m_UsePrecomputedOPDTable || useMatrixProduct || generateJacobian);
+    }
+
+  if (useMatrixProduct && !generateJacobian)
+    {
+    this->ComputeBesselMatrix();
+    }
+
+  if (generateJacobian)
+    {
+    this->ComputeLogarithmicDerivatives();
+    }
+
+  // Size the per-thread scratch space for the tabulated quadrature.
+  unsigned int numberOfNodes = this->m_IntegrandFunctor.m_RhoTable.size();
+  this->m_NodeScratch.resize(this->GetNumberOfThreads());
+  for (unsigned int i = 0; i < this->m_NodeScratch.size(); i++)
+    {
+    this->m_NodeScratch[i].arguments.resize(numberOfNodes);
+    this->m_NodeScratch[i].bessel.resize(numberOfNodes);
+    if (this->m_IntegrandPrecision == SINGLE_PRECISION)
+      {
+      this->m_NodeScratch[i].singleArguments.resize(numberOfNodes);
+      this->m_NodeScratch[i].singleBessel.resize(numberOfNodes);
+      }
+    if (generateJacobian)
+      {
+      this->m_NodeScratch[i].besselSlope.resize(numberOfNodes);
+      this->m_NodeScratch[i].derivativeSums.resize
+        (this->m_JacobianParameters.size());
+      }
+    }
+
+  // Queue the tiles of each thread's part of the output. Threads that
+  // run out of tiles steal them from the others.
+  RegionType splitRegion;
+  int numberOfThreads = this->GetNumberOfThreads();
+  int numberOfSplits = this->SplitRequestedRegion(0, numberOfThreads, splitRegion);
+  this->m_Scheduler->Initialize(numberOfSplits);
+  for (int i = 0; i < numberOfSplits; i++)
+    {
+    this->SplitRequestedRegion(i, numberOfThreads, splitRegion);
+
+    typename SchedulerType::SizeType tileSize = this->m_Scheduler->GetTileSize();
+    if (useMatrixProduct && !generateJacobian)
+      {
+      tileSize = splitRegion.GetSize();
+      }
+    else if (this->m_UseRadialProfile && !generateJacobian)
+      {
+      tileSize = splitRegion.GetSize();
+      tileSize[2] = 1;
+      }
+    this->m_Scheduler->AddRegion(i, splitRegion, tileSize);
+    }
 }
 
 
 //----------------------------------------------------------------------------
 template< class TOutputImage >
 void
-GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
-::ThreadedGenerateData(const RegionType& outputRegionForThread, int threadId )
+GibsonLanniPointSpreadFunctionImageSource< TOutputImage >
+::InitializeIntegrandFunctor(bool tabulate)
 {
-  // Support progress methods/callbacks
-  ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels());
+  this->m_IntegrandFunctor.CopySettings(this);
 
+  // Build the J0 table for the largest argument needed in the
+  // requested region, which occurs at rho = 1.
+  this->m_IntegrandFunctor.m_UseFastBesselJ0 = this->m_BesselJ0MaximumError > 0.0;
+  if (this->m_IntegrandFunctor.m_UseFastBesselJ0)
+    {
+    double maxRadius, zMin, zMax;
+    this->GetRequestedRegionExtent(maxRadius, zMin, zMax);
+    double maxArgument = this->m_IntegrandFunctor.m_K *
+      this->m_IntegrandFunctor.m_A * maxRadius * 1e-9 *
+      this->m_Magnification / (0.160 + zMin * 1e-9);
+    this->m_IntegrandFunctor.m_FastBesselJ0.Initialize
+      (maxArgument, this->m_BesselJ0MaximumError);
+    }
+
+  if (tabulate)
+    {
+    this->m_IntegrandFunctor.PrecomputeOPDTable
+      (0.0, 1.0, this->m_NumberOfIntegrationSubdivisions);
+
+    if (this->m_IntegrandPrecision == SINGLE_PRECISION)
+      {
+      this->m_IntegrandFunctor.PrecomputeSinglePrecisionTables();
+      }
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+double
+GibsonLanniPointSpreadFunctionImageSource< TOutputImage >
+::ComputeMaximumSinglePrecisionDeviation()
+{
+  this->UpdateOutputInformation();
   typename TOutputImage::Pointer image = this->GetOutput(0);
+  image->SetRequestedRegionToLargestPossibleRegion();
 
-  ImageRegionIteratorWithIndex<OutputImageType> it(image, outputRegionForThread);
+  this->InitializeIntegrandFunctor(true);
+  this->m_IntegrandFunctor.PrecomputeSinglePrecisionTables();
 
-  for (; !it.IsAtEnd(); ++it)
+  const FunctorType& functor = this->m_IntegrandFunctor;
+  unsigned int numberOfNodes = functor.m_RhoTable.size();
+  std::vector<double> arguments(numberOfNodes);
+  std::vector<double> bessel(numberOfNodes);
+  std::vector<float>  singleArguments(numberOfNodes);
+  std::vector<float>  singleBessel(numberOfNodes);
+
+  double mag = this->m_Magnification;
+  double maxValue = 0.0;
+  double maxDeviation = 0.0;
+
+  // The output need not be allocated, so visit the pixel indices
+  // without an image iterator.
+  RegionType region = image->GetLargestPossibleRegion();
+  IndexType  start  = region.GetIndex();
+  SizeType   size   = region.GetSize();
+  IndexType  index;
+  PointType  point;
+  for (SizeValueType k = 0; k < size[2]; k++)
     {
-    IndexType index = it.GetIndex();
-    PointType point;
-    image->TransformIndexToPhysicalPoint(index, point);
+    for (SizeValueType j = 0; j < size[1]; j++)
+      {
+      for (SizeValueType i = 0; i < size[0]; i++)
+        {
+        index[0] = start[0] + i;
+        index[1] = start[1] + j;
+        index[2] = start[2] + k;
+        image->TransformIndexToPhysicalPoint(index, point);
+
+        double x_o = point[0] * 1e-9 * mag;
+        double y_o = point[1] * 1e-9 * mag;
+        double z_o = point[2] * 1e-9;
+        double r   = sqrt(x_o*x_o + y_o*y_o);
+
+        double value = norm(functor.SumAtNodes(r, z_o, &arguments[0], &bessel[0]));
+        double singleValue = functor.SumAtNodesSinglePrecision
+          (r, z_o, &singleArguments[0], &singleBessel[0]);
+
+        double deviation = fabs(singleValue - value);
+        if (value > maxValue) maxValue = value;
+        if (deviation > maxDeviation) maxDeviation = deviation;
+        }
+      }
+    }
+
+  return maxValue > 0.0 ? maxDeviation / maxValue : 0.0;
+}
+
 
-    it.Set( ComputeSampleValue( point ));
-    progress.CompletedPixel();
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ThreadedGenerateData(const RegionType& itkNotUsed(outputRegionForThread), int threadId )
+{
+  unsigned long evaluations = 0;
+
+  RegionType tile;
+  while (this->m_Scheduler->GetNextTile(threadId, tile))
+    {
+    if (!this->m_JacobianParameters.empty())
+      {
+      this->GenerateJacobianData(tile, threadId, evaluations);
+      }
+    else if (this->m_UseRadialProfile)
+      {
+      if (this->m_RadialProfileMethod == MATRIX_PRODUCT_PROFILE)
+        {
+        this->GenerateDataFromMatrixProduct(tile);
+        }
+      else
+        {
+        this->GenerateDataFromRadialProfiles(tile, threadId, evaluations);
+        }
+      }
+    else
+      {
+      typename TOutputImage::Pointer image = this->GetOutput(0);
+
+      ImageRegionIteratorWithIndex<OutputImageType> it(image, tile);
+
+      for (; !it.IsAtEnd(); ++it)
+        {
+        IndexType index = it.GetIndex();
+        PointType point;
+        image->TransformIndexToPhysicalPoint(index, point);
+
+        it.Set( ComputeSampleValue( point, threadId, evaluations ));
+        }
+      }
+
+    this->m_Scheduler->ReportProgress(this, threadId);
     }
+
+  this->m_IntegrandEvaluationsPerThread[threadId] += evaluations;
 }
 
 
@@ -308,7 +576,8 @@ GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
 template< class TOutputImage >
 double
 GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
-::ComputeSampleValue(typename TOutputImage::PointType& point)
+::ComputeSampleValue(typename TOutputImage::PointType& point, int threadId,
+                     unsigned long& evaluations)
 {
   PixelType px = point[0] * 1e-9;
   PixelType py = point[1] * 1e-9;
@@ -321,9 +590,426 @@ GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
   double y_o = py * mag;
   double z_o = pz; // No conversion needed
 
+  return this->ComputeRadialSampleValue(sqrt(x_o*x_o + y_o*y_o), z_o,
+                                        threadId, evaluations);
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+double
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeRadialSampleValue(double r, double z, int threadId,
+                           unsigned long& evaluations)
+{
   // Return squared magnitude of the integrated value
+  if (this->m_IntegrationRelativeTolerance > 0.0)
+    {
+    return static_cast<PixelType>(
+      norm( this->IntegrateAdaptive( this->m_IntegrandFunctor, 0.0, 1.0,
+                                     r, 0.0, z, evaluations)));
+    }
+
+  evaluations += 2*this->m_NumberOfIntegrationSubdivisions + 1;
+
+  if (this->m_UsePrecomputedOPDTable)
+    {
+    // Evaluate the Bessel term at all nodes in one batch.
+    const FunctorType& functor = this->m_IntegrandFunctor;
+    NodeScratch& scratch = this->m_NodeScratch[threadId];
+
+    if (this->m_IntegrandPrecision == SINGLE_PRECISION)
+      {
+      return static_cast<PixelType>(
+        functor.SumAtNodesSinglePrecision(r, z, &scratch.singleArguments[0],
+                                          &scratch.singleBessel[0]));
+      }
+
+    return static_cast<PixelType>(
+      norm(functor.SumAtNodes(r, z, &scratch.arguments[0],
+                              &scratch.bessel[0])));
+    }
+
   return static_cast<PixelType>(
-    norm( Integrate( this->m_IntegrandFunctor, 0.0, 1.0, 20, x_o, y_o, z_o)));
+    norm( this->Integrate( this->m_IntegrandFunctor, 0.0, 1.0,
+                           this->m_NumberOfIntegrationSubdivisions, r, 0.0, z)));
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeLogarithmicDerivatives()
+{
+  // The Bessel argument is proportional to K * A * r, the detector
+  // radius r is proportional to the magnification, and
+  // A = 0.160 * NA / sqrt(M^2 - NA^2).
+  double lambda = this->m_EmissionWavelength;
+  double NA     = this->m_NumericalAperture;
+  double M      = this->m_Magnification;
+
+  unsigned int numberOfDerivatives = this->m_JacobianParameters.size();
+  this->m_LogArgumentDerivatives.assign(numberOfDerivatives, 0.0);
+  this->m_LogWavenumberDerivatives.assign(numberOfDerivatives, 0.0);
+  for (unsigned int d = 0; d < numberOfDerivatives; d++)
+    {
+    switch (this->m_JacobianParameters[d])
+      {
+      case 0:
+        this->m_LogArgumentDerivatives[d]   = -1.0 / lambda;
+        this->m_LogWavenumberDerivatives[d] = -1.0 / lambda;
+        break;
+
+      case 1:
+        this->m_LogArgumentDerivatives[d] = M*M / (NA * (M*M - NA*NA));
+        break;
+
+      case 2:
+        this->m_LogArgumentDerivatives[d] = -NA*NA / (M * (M*M - NA*NA));
+        break;
+      }
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+double
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeRadialSampleDerivatives(double r, double z, double* derivatives,
+                                 int threadId, unsigned long& evaluations)
+{
+  const FunctorType& functor = this->m_IntegrandFunctor;
+  unsigned int numberOfNodes       = functor.m_RhoTable.size();
+  unsigned int numberOfDerivatives = this->m_JacobianParameters.size();
+
+  evaluations += numberOfNodes;
+
+  NodeScratch& scratch = this->m_NodeScratch[threadId];
+  const double* arguments   = &scratch.arguments[0];
+  const double* bessel      = &scratch.bessel[0];
+  const double* besselSlope = &scratch.besselSlope[0];
+  functor.EvaluateBesselAndSlopeAtNodes(r, z, &scratch.arguments[0],
+                                        &scratch.bessel[0],
+                                        &scratch.besselSlope[0]);
+
+  const double* logArgumentDerivatives   = &this->m_LogArgumentDerivatives[0];
+  const double* logWavenumberDerivatives = &this->m_LogWavenumberDerivatives[0];
+
+  const ComplexType I(0.0, 1.0);
+  ComplexType sum = 0.0;
+  ComplexType* derivativeSums = &scratch.derivativeSums[0];
+  for (unsigned int d = 0; d < numberOfDerivatives; d++)
+    {
+    derivativeSums[d] = 0.0;
+    }
+
+  for (unsigned int i = 0; i < numberOfNodes; i++)
+    {
+    double rho    = functor.m_RhoTable[i];
+    double weight = functor.m_WeightTable[i] * rho;
+    ComplexType opd   = functor.m_OPDConstantTable[i] + z * functor.m_OPDDefocusTable[i];
+    ComplexType phase = exp(I * opd * functor.m_K);
+
+    sum += (weight * bessel[i]) * phase;
+
+    // x * dJ0/dx at the Bessel argument x.
+    double scaledSlope = besselSlope[i] * arguments[i];
+
+    for (unsigned int d = 0; d < numberOfDerivatives; d++)
+      {
+      ComplexType phaseDerivative = I * functor.m_K *
+        (functor.OPDDerivative(rho, z, this->m_JacobianParameters[d]) +
+         logWavenumberDerivatives[d] * opd);
+
+      derivativeSums[d] += weight * phase *
+        (scaledSlope * logArgumentDerivatives[d] + bessel[i] * phaseDerivative);
+      }
+    }
+
+  // The intensity is |sum|^2.
+  for (unsigned int d = 0; d < numberOfDerivatives; d++)
+    {
+    derivatives[d] = 2.0 * real(conj(sum) * derivativeSums[d]);
+    }
+
+  return norm(sum);
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::GenerateJacobianData(const RegionType& region, int threadId,
+                       unsigned long& evaluations)
+{
+  typename TOutputImage::Pointer image = this->GetOutput(0);
+  double mag = this->m_Magnification;
+
+  unsigned int numberOfDerivatives = this->m_JacobianParameters.size();
+  typedef ImageRegionIterator<OutputImageType> JacobianIteratorType;
+  std::vector<JacobianIteratorType> jacobianIterators(numberOfDerivatives);
+  for (unsigned int d = 0; d < numberOfDerivatives; d++)
+    {
+    jacobianIterators[d] = JacobianIteratorType
+      ((*this->m_Jacobian)[this->m_JacobianParameters[d]], region);
+    }
+
+  std::vector<double> derivatives(numberOfDerivatives);
+
+  PointType point;
+  ImageRegionIteratorWithIndex<OutputImageType> it(image, region);
+  for (; !it.IsAtEnd(); ++it)
+    {
+    image->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+
+    // Detector coordinates, as in ComputeSampleValue().
+    double x_o = point[0] * 1e-9 * mag;
+    double y_o = point[1] * 1e-9 * mag;
+    double z_o = point[2] * 1e-9;
+
+    it.Set( static_cast<PixelType>
+            (this->ComputeRadialSampleDerivatives(sqrt(x_o*x_o + y_o*y_o), z_o,
+                                                  &derivatives[0], threadId,
+                                                  evaluations)) );
+
+    for (unsigned int d = 0; d < numberOfDerivatives; d++)
+      {
+      jacobianIterators[d].Set( static_cast<PixelType>(derivatives[d]) );
+      ++jacobianIterators[d];
+      }
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::GenerateDataFromRadialProfiles(const RegionType& region, int threadId,
+                                 unsigned long& evaluations)
+{
+  double mag = this->m_Magnification;
+
+  // Radial profile spacing in detector coordinates (meters).
+  double pixelSpacing = this->m_Spacing[0] < this->m_Spacing[1] ?
+    this->m_Spacing[0] : this->m_Spacing[1];
+  double dr = pixelSpacing * 1e-9 * mag /
+    static_cast<double>(this->m_RadialProfileSubsamplingFactor);
+
+  std::vector<double> profile;
+
+  for (SizeValueType k = 0; k < region.GetSize()[2]; k++)
+    {
+    RegionType sliceRegion;
+    double maxRadius, z;
+    this->GetSliceExtent(region, k, sliceRegion, maxRadius, z);
+    double z_o = z * 1e-9;
+
+    // Integrate the radial profile for this slice.
+    unsigned int profileSize = Math::Ceil<unsigned int>(maxRadius * 1e-9 * mag / dr) + 2;
+    profile.resize(profileSize);
+    for (unsigned int j = 0; j < profileSize; j++)
+      {
+      profile[j] = this->ComputeRadialSampleValue(static_cast<double>(j) * dr, z_o,
+                                                  threadId, evaluations);
+      }
+
+    this->FillSliceFromRadialProfile(sliceRegion, profile, dr);
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::GenerateDataFromMatrixProduct(const RegionType& region)
+{
+  const FunctorType& functor = this->m_IntegrandFunctor;
+  unsigned int numberOfNodes  = functor.m_RhoTable.size();
+  unsigned int numberOfSlices = region.GetSize()[2];
+  unsigned int numberOfColumns = 2 * numberOfSlices;
+
+  std::vector<RegionType> sliceRegions(numberOfSlices);
+  std::vector<double>     sliceZ(numberOfSlices);
+  for (unsigned int k = 0; k < numberOfSlices; k++)
+    {
+    double maxRadius;
+    this->GetSliceExtent(region, k, sliceRegions[k], maxRadius, sliceZ[k]);
+    sliceZ[k] *= 1e-9;
+    }
+
+  // Phase matrix with one row per quadrature node. The real and
+  // imaginary parts of the phase factor of each slice occupy adjacent
+  // columns.
+  std::vector<double> phase(numberOfNodes * numberOfColumns);
+  for (unsigned int i = 0; i < numberOfNodes; i++)
+    {
+    double* phaseRow = &phase[i * numberOfColumns];
+    for (unsigned int k = 0; k < numberOfSlices; k++)
+      {
+      ComplexType opd = functor.m_OPDConstantTable[i] +
+        sliceZ[k] * functor.m_OPDDefocusTable[i];
+      ComplexType value = exp(ComplexType(0.0, 1.0) * opd * functor.m_K);
+      phaseRow[2*k]   = value.real();
+      phaseRow[2*k+1] = value.imag();
+      }
+    }
+
+  unsigned int numberOfRows = this->m_BesselMatrixRows;
+  std::vector<double> product(numberOfRows * numberOfColumns);
+  BlockedMatrixProduct(&this->m_BesselMatrix[0], &phase[0], &product[0],
+                       numberOfRows, numberOfNodes, numberOfColumns);
+
+  std::vector<double> profile(numberOfRows);
+  for (unsigned int k = 0; k < numberOfSlices; k++)
+    {
+    for (unsigned int j = 0; j < numberOfRows; j++)
+      {
+      double re = product[j * numberOfColumns + 2*k];
+      double im = product[j * numberOfColumns + 2*k + 1];
+      profile[j] = re*re + im*im;
+      }
+
+    // The profile is uniform in the scaled radius, so its spacing in
+    // detector coordinates depends on the slice.
+    double dr = this->m_ScaledRadiusSpacing * (0.160 + sliceZ[k]);
+    this->FillSliceFromRadialProfile(sliceRegions[k], profile, dr);
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::ComputeBesselMatrix()
+{
+  double mag = this->m_Magnification;
+
+  double maxRadius, zMin, zMax;
+  this->GetRequestedRegionExtent(maxRadius, zMin, zMax);
+  zMin *= 1e-9;
+  zMax *= 1e-9;
+
+  // Choose the scaled radius spacing so that the radial spacing in
+  // detector coordinates is no coarser than the quadrature profile
+  // spacing in any slice.
+  double pixelSpacing = this->m_Spacing[0] < this->m_Spacing[1] ?
+    this->m_Spacing[0] : this->m_Spacing[1];
+  double dr = pixelSpacing * 1e-9 * mag /
+    static_cast<double>(this->m_RadialProfileSubsamplingFactor);
+  double ds = dr / (0.160 + zMax);
+  double maxScaledRadius = maxRadius * 1e-9 * mag / (0.160 + zMin);
+
+  const FunctorType& functor = this->m_IntegrandFunctor;
+  unsigned int numberOfNodes = functor.m_RhoTable.size();
+  unsigned int numberOfRows  = Math::Ceil<unsigned int>(maxScaledRadius / ds) + 2;
+
+  this->m_ScaledRadiusSpacing = ds;
+  this->m_BesselMatrixRows    = numberOfRows;
+  this->m_BesselMatrix.resize(numberOfRows * numberOfNodes);
+
+  // The scaled radius s corresponds to a detector radius of
+  // s * (0.160 + z) at defocus z, so the Bessel term of row j is that
+  // of radius j * ds at zero defocus.
+  std::vector<double> arguments(numberOfNodes);
+  for (unsigned int j = 0; j < numberOfRows; j++)
+    {
+    double s = static_cast<double>(j) * ds;
+    double* besselRow = &this->m_BesselMatrix[j * numberOfNodes];
+    functor.EvaluateBesselAtNodes(s * 0.160, 0.0, &arguments[0], besselRow);
+    for (unsigned int i = 0; i < numberOfNodes; i++)
+      {
+      besselRow[i] *= functor.m_WeightTable[i] * functor.m_RhoTable[i];
+      }
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::GetRequestedRegionExtent(double& maxRadius, double& zMin, double& zMax)
+{
+  RegionType region = this->GetOutput(0)->GetRequestedRegion();
+
+  // The radial extent is the same for every slice.
+  RegionType sliceRegion;
+  double zFirst, zLast;
+  this->GetSliceExtent(region, 0, sliceRegion, maxRadius, zFirst);
+  this->GetSliceExtent(region, region.GetSize()[2]-1, sliceRegion, maxRadius, zLast);
+  zMin = zFirst < zLast ? zFirst : zLast;
+  zMax = zFirst < zLast ? zLast : zFirst;
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::GetSliceExtent(const RegionType& region, SizeValueType k,
+                 RegionType& sliceRegion, double& maxRadius,
+                 double& z)
+{
+  typename TOutputImage::Pointer image = this->GetOutput(0);
+
+  IndexType sliceIndex = region.GetIndex();
+  SizeType  sliceSize  = region.GetSize();
+  sliceIndex[2] += k;
+  sliceSize[2]   = 1;
+  sliceRegion.SetIndex(sliceIndex);
+  sliceRegion.SetSize(sliceSize);
+
+  // The farthest point of the slice from the optical axis is one of
+  // its corners.
+  maxRadius = 0.0;
+  PointType point;
+  for (unsigned int corner = 0; corner < 4; corner++)
+    {
+    IndexType cornerIndex = sliceIndex;
+    if (corner & 1) cornerIndex[0] += sliceSize[0] - 1;
+    if (corner & 2) cornerIndex[1] += sliceSize[1] - 1;
+    image->TransformIndexToPhysicalPoint(cornerIndex, point);
+
+    double radius = sqrt(point[0]*point[0] + point[1]*point[1]);
+    if (radius > maxRadius) maxRadius = radius;
+    }
+  z = point[2];
+}
+
+
+//----------------------------------------------------------------------------
+template< class TOutputImage >
+void
+GibsonLanniPointSpreadFunctionImageSource<TOutputImage>
+::FillSliceFromRadialProfile(const RegionType& sliceRegion,
+                             const std::vector<double>& profile,
+                             double dr)
+{
+  typename TOutputImage::Pointer image = this->GetOutput(0);
+  double mag = this->m_Magnification;
+  unsigned int profileSize = profile.size();
+
+  // Fill the slice by linear interpolation in r.
+  PointType point;
+  ImageRegionIteratorWithIndex<OutputImageType> it(image, sliceRegion);
+  for (; !it.IsAtEnd(); ++it)
+    {
+    image->TransformIndexToPhysicalPoint(it.GetIndex(), point);
+    double r = sqrt(point[0]*point[0] + point[1]*point[1]) * 1e-9 * mag;
+
+    double t = r / dr;
+    unsigned int j = static_cast<unsigned int>(t);
+    if (j > profileSize - 2) j = profileSize - 2;
+    double f = t - static_cast<double>(j);
+
+    it.Set( static_cast<PixelType>((1.0 - f)*profile[j] + f*profile[j+1]) );
+    }
 }
 
 } // end namespace itk
@@ -30,6 +30,7 @@
 #include "itkImageToImageMetric.h"
 #include "itkInterpolateImageFunction.h"
 #include "itkSingleValuedCostFunction.h"
+#include "itkSpatialObject.h"
 
 namespace itk
 {
@@ -51,6 +52,12 @@ namespace itk
  * is the fixed image data and the second template class is the source of
  * the moving ParametricImageSource.
  *
+ * The moving image source is asked to generate only the region of the
+ * moving image that the metric compares, which is the fixed image
+ * region, narrowed to the bounding box of the fixed image mask if one
+ * is set, padded by a voxel for the interpolator. The fixed and moving
+ * images are assumed to share their physical space.
+ *
  * \ingroup RegistrationMetrics
  *
  */
@@ -86,6 +93,8 @@ public:
   typedef TFixedImage                                FixedImageType;
   typedef typename FixedImageType::ConstPointer      FixedImageConstPointer;
   typedef typename FixedImageType::RegionType        FixedImageRegionType;
+  typedef typename MovingImageSourceOutputImageType::RegionType
+    MovingImageRegionType;
 
   /**  Type of the delegate image comparison metric. */
   typedef ImageToImageMetric<FixedImageType, MovingImageSourceOutputImageType>
@@ -120,6 +129,11 @@ public:
   typedef InterpolateImageFunction<FixedImageType, double>  InterpolatorType;
   typedef typename InterpolatorType::Pointer                InterpolatorTypePointer;
 
+  /** Type of the fixed image mask. */
+  typedef SpatialObject< itkGetStaticConstMacro(FixedImageDimension) >
+    FixedImageMaskType;
+  typedef typename FixedImageMaskType::ConstPointer FixedImageMaskConstPointer;
+
   /** Connect the Fixed Image.  */
   itkSetConstObjectMacro(FixedImage, FixedImageType);
 
@@ -146,22 +160,43 @@ public:
   const unsigned long & GetNumberOfPixelsCounted() const;
 
   /** Set the region over which the metric will be computed. Forward to
-   * the ImageToImageMetric. */
+   * the ImageToImageMetric. Only the part of the moving image over this
+   * region is generated. Defaults to the largest possible region of
+   * the fixed image. */
   virtual void SetFixedImageRegion(FixedImageRegionType region);
 
   /** Get the region over which the metric will be computed */
   virtual const FixedImageRegionType & GetFixedImageRegion();
 
+  /** Set/get the fixed image mask. Forwarded to the ImageToImageMetric,
+   * which compares only the fixed image points inside the mask. The
+   * moving image is generated over the bounding box of the mask within
+   * the fixed image region. */
+  itkSetConstObjectMacro(FixedImageMask, FixedImageMaskType);
+  itkGetConstObjectMacro(FixedImageMask, FixedImageMaskType);
+
   /** Set the delegate ImageToImageMetric. */
   virtual void SetDelegateMetric(DelegateMetricType* source);
 
   /** Get the delegate ImageToImageMetric. */
   itkGetConstObjectMacro( DelegateMetric, DelegateMetricType );
 
-  /** Get the derivative of the cost function (calling this returns an
-      undefined derivative); */
+  /** Get the derivative of the cost function with respect to the
+      active parameters. The moving image source generates its image
+      together with the derivatives of the image with respect to the
+      active parameters, analytically where it can. The derivative of
+      the cost function with respect to each parameter is then the
+      derivative of the delegate metric along the corresponding image
+      derivative, which is approximated with a central difference of
+      two metric evaluations. No further images are generated. */
   virtual void GetDerivative(const ParametersType& parameters, DerivativeType& derivative) const;
 
+  /** Set/get the step of the central differences of the delegate
+      metric along the image derivatives, relative to the largest
+      magnitude of the moving image. Defaults to 1e-3. */
+  itkSetMacro(DerivativeStep, double);
+  itkGetConstMacro(DerivativeStep, double);
+
   /** Get the value of the cost function. The parameters argument should
       contain the values of the active parameters only (in order), not the
       full set of parameters. */
@@ -205,6 +240,29 @@ protected:
   /** Mask for parameters. */
   ParametersMaskType        m_ParametersMask;
 
+  /** Relative step of the directional differences in GetDerivative(). */
+  double                    m_DerivativeStep;
+
+  /** Region of the fixed image set with SetFixedImageRegion(). */
+  FixedImageRegionType      m_FixedImageRegion;
+  bool                      m_FixedImageRegionDefined;
+
+  FixedImageMaskConstPointer m_FixedImageMask;
+
+  /** Computes the region of the fixed image compared by the delegate
+   * metric, the fixed image region cropped to the bounding box of the
+   * mask. */
+  FixedImageRegionType ComputeComparedFixedImageRegion() const;
+
+  /** Sets the requested region of the moving image source output to
+   * the part of the moving image covering the compared fixed image
+   * region. */
+  void SetMovingImageRequestedRegion() const;
+
+  /** Evaluates the delegate metric with the given moving image. */
+  MeasureType EvaluateDelegateMetric(MovingImageSourceOutputImageType* movingImage,
+                                     const ParametersType& parameters) const;
+
 private:
   ImageToParametricImageSourceMetric(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
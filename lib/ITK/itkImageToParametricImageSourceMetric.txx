@@ -23,6 +23,12 @@
 #include "itkConfigure.h"
 
 #include "itkImageToParametricImageSourceMetric.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+#include "itkContinuousIndex.h"
+#include "itkMath.h"
+
+#include <algorithm>
 
 namespace itk
 {
@@ -40,6 +46,9 @@ ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
   m_Transform         = TransformType::New(); // immutable
   m_Interpolator      = 0; // has to be provided by the user.
   m_ParametersMask    = ParametersMaskType(0);
+  m_DerivativeStep    = 1e-3;
+  m_FixedImageRegionDefined = false;
+  m_FixedImageMask    = 0;
 }
 
 
@@ -107,6 +116,10 @@ template <class TFixedImage, class TMovingImageSource>
 void
 ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
 ::SetFixedImageRegion(FixedImageRegionType region) {
+  m_FixedImageRegion = region;
+  m_FixedImageRegionDefined = true;
+  this->Modified();
+
   if ( m_DelegateMetric )
     {
     m_DelegateMetric->SetFixedImageRegion(region);
@@ -119,7 +132,118 @@ const typename ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource
 ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
 ::GetFixedImageRegion()
 {
-  return m_DelegateMetric->GetFixedImageRegion();
+  if ( !m_FixedImageRegionDefined && m_FixedImage )
+    {
+    m_FixedImageRegion = m_FixedImage->GetLargestPossibleRegion();
+    }
+  return m_FixedImageRegion;
+}
+
+
+template <class TFixedImage, class TMovingImageSource>
+typename ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>::FixedImageRegionType
+ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
+::ComputeComparedFixedImageRegion() const
+{
+  FixedImageRegionType region = m_FixedImage->GetLargestPossibleRegion();
+  if ( m_FixedImageRegionDefined )
+    {
+    FixedImageRegionType definedRegion = m_FixedImageRegion;
+    if ( definedRegion.Crop(region) )
+      {
+      region = definedRegion;
+      }
+    }
+
+  if ( !m_FixedImageMask )
+    {
+    return region;
+    }
+
+  // Crop to the bounding box of the mask, rounded outwards to voxels.
+  m_FixedImageMask->ComputeBoundingBox();
+  typename FixedImageMaskType::BoundingBoxType* box =
+    m_FixedImageMask->GetBoundingBox();
+
+  typedef ContinuousIndex< double, FixedImageDimension > ContinuousIndexType;
+  ContinuousIndexType minimum;
+  ContinuousIndexType maximum;
+  Point< double, FixedImageDimension > minimumPoint;
+  Point< double, FixedImageDimension > maximumPoint;
+  for ( unsigned int i = 0; i < FixedImageDimension; i++ )
+    {
+    minimumPoint[i] = box->GetMinimum()[i];
+    maximumPoint[i] = box->GetMaximum()[i];
+    }
+  m_FixedImage->TransformPhysicalPointToContinuousIndex(minimumPoint, minimum);
+  m_FixedImage->TransformPhysicalPointToContinuousIndex(maximumPoint, maximum);
+
+  typename FixedImageType::IndexType index;
+  typename FixedImageType::SizeType  size;
+  for ( unsigned int i = 0; i < FixedImageDimension; i++ )
+    {
+    long first = Math::Floor<long>(std::min(minimum[i], maximum[i]));
+    long last  = Math::Ceil<long>(std::max(minimum[i], maximum[i]));
+    index[i] = first;
+    size[i]  = static_cast<typename FixedImageType::SizeType::SizeValueType>(last - first + 1);
+    }
+
+  FixedImageRegionType maskRegion(index, size);
+  if ( maskRegion.Crop(region) )
+    {
+    region = maskRegion;
+    }
+
+  return region;
+}
+
+
+template <class TFixedImage, class TMovingImageSource>
+void
+ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
+::SetMovingImageRequestedRegion() const
+{
+  m_MovingImageSource->UpdateOutputInformation();
+  MovingImageSourceOutputImageType* movingImage = m_MovingImageSource->GetOutput();
+  MovingImageRegionType largestRegion = movingImage->GetLargestPossibleRegion();
+
+  // Map the corners of the compared fixed image region to the moving
+  // image and pad by a voxel for the interpolator.
+  FixedImageRegionType fixedRegion = this->ComputeComparedFixedImageRegion();
+  typename FixedImageType::IndexType firstIndex = fixedRegion.GetIndex();
+  typename FixedImageType::IndexType lastIndex  = fixedRegion.GetIndex();
+  for ( unsigned int i = 0; i < FixedImageDimension; i++ )
+    {
+    lastIndex[i] += static_cast<long>(fixedRegion.GetSize()[i]) - 1;
+    }
+
+  typedef Point< double, MovingImageSourceDimension > PointType;
+  typedef ContinuousIndex< double, MovingImageSourceDimension > ContinuousIndexType;
+  PointType firstPoint;
+  PointType lastPoint;
+  m_FixedImage->TransformIndexToPhysicalPoint(firstIndex, firstPoint);
+  m_FixedImage->TransformIndexToPhysicalPoint(lastIndex, lastPoint);
+  ContinuousIndexType first;
+  ContinuousIndexType last;
+  movingImage->TransformPhysicalPointToContinuousIndex(firstPoint, first);
+  movingImage->TransformPhysicalPointToContinuousIndex(lastPoint, last);
+
+  typename MovingImageRegionType::IndexType index;
+  typename MovingImageRegionType::SizeType  size;
+  for ( unsigned int i = 0; i < MovingImageSourceDimension; i++ )
+    {
+    long lower = Math::Floor<long>(std::min(first[i], last[i])) - 1;
+    long upper = Math::Ceil<long>(std::max(first[i], last[i])) + 1;
+    index[i] = lower;
+    size[i]  = static_cast<typename MovingImageRegionType::SizeType::SizeValueType>(upper - lower + 1);
+    }
+
+  MovingImageRegionType region(index, size);
+  if ( !region.Crop(largestRegion) )
+    {
+    region = largestRegion;
+    }
+  movingImage->SetRequestedRegion(region);
 }
 
 
@@ -145,31 +269,99 @@ void
 ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
 ::GetDerivative(const ParametersType& parameters, DerivativeType& derivative) const
 {
-  // Do nothing.
+  SetParameters(parameters);
+
+  // Generate the moving image and its derivatives with respect to the
+  // active parameters over the region the metric compares.
+  this->SetMovingImageRequestedRegion();
+  typename MovingImageSourceType::JacobianType jacobian;
+  m_MovingImageSource->GenerateJacobian(m_ParametersMask, jacobian);
+
+  MovingImageSourceOutputImagePointerType movingImage =
+    m_MovingImageSource->GetOutput();
+  MovingImageRegionType region = movingImage->GetRequestedRegion();
+
+  typedef ImageRegionConstIterator< MovingImageSourceOutputImageType > ConstIteratorType;
+  typedef ImageRegionIterator< MovingImageSourceOutputImageType >      IteratorType;
+
+  double maxValue = 0.0;
+  for (ConstIteratorType it(movingImage, region); !it.IsAtEnd(); ++it)
+    {
+    double value = fabs(static_cast<double>(it.Get()));
+    if (value > maxValue) maxValue = value;
+    }
+
+  // Image perturbed along one derivative.
+  MovingImageSourceOutputImagePointerType perturbedImage =
+    MovingImageSourceOutputImageType::New();
+  perturbedImage->CopyInformation(movingImage);
+  perturbedImage->SetBufferedRegion(region);
+  perturbedImage->SetRequestedRegion(region);
+  perturbedImage->Allocate();
+
+  derivative = DerivativeType(this->GetNumberOfParameters());
+  derivative.Fill(0.0);
+
+  unsigned int activeIndex = 0;
+  for (unsigned int i = 0; i < m_ParametersMask.Size(); i++)
+    {
+    if ( !m_ParametersMask[i] )
+      {
+      continue;
+      }
+
+    MovingImageSourceOutputImageType* imageDerivative = jacobian[i];
+
+    double maxDerivative = 0.0;
+    for (ConstIteratorType it(imageDerivative, region); !it.IsAtEnd(); ++it)
+      {
+      double value = fabs(static_cast<double>(it.Get()));
+      if (value > maxDerivative) maxDerivative = value;
+      }
+
+    if (maxDerivative > 0.0)
+      {
+      // Scale the step so that the largest change of the image is a
+      // fixed fraction of its largest value.
+      double step = m_DerivativeStep * (maxValue > 0.0 ? maxValue : 1.0) / maxDerivative;
+      MeasureType values[2];
+      for (int side = 0; side < 2; side++)
+        {
+        double signedStep = side == 0 ? step : -step;
+        ConstIteratorType mit(movingImage, region);
+        ConstIteratorType dit(imageDerivative, region);
+        IteratorType      pit(perturbedImage, region);
+        for (; !pit.IsAtEnd(); ++pit, ++mit, ++dit)
+          {
+          pit.Set( static_cast<MovingImageSourcePixelType>
+                   (mit.Get() + signedStep * dit.Get()) );
+          }
+        values[side] = this->EvaluateDelegateMetric(perturbedImage, parameters);
+        }
+      derivative[activeIndex] = (values[0] - values[1]) / (2.0 * step);
+      }
+
+    activeIndex++;
+    }
+
+  // Leave the delegate metric set up with the generated image.
+  this->EvaluateDelegateMetric(movingImage, parameters);
 }
 
 
 template <class TFixedImage, class TMovingImageSource>
 typename ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>::MeasureType
 ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
-::GetValue(const ParametersType& parameters) const
+::EvaluateDelegateMetric(MovingImageSourceOutputImageType* movingImage,
+                         const ParametersType& parameters) const
 {
-  // Send the parameters to the parametric image source.
-  std::cout << "Parameters: " << parameters << std::endl;
-  SetParameters(parameters);
-
-  // Now update the parametric image source.
-  m_MovingImageSource->GetOutput()->SetRequestedRegionToLargestPossibleRegion();
-  m_MovingImageSource->Update();
-
   m_DelegateMetric->SetFixedImage(m_FixedImage);
-  m_DelegateMetric->
-    SetFixedImageRegion(m_FixedImage->GetLargestPossibleRegion());
+  m_DelegateMetric->SetFixedImageRegion(this->ComputeComparedFixedImageRegion());
+  m_DelegateMetric->SetFixedImageMask
+    (const_cast< FixedImageMaskType* >(m_FixedImageMask.GetPointer()));
 
   // Have to set the new moving image in the interpolator manually because
   // the delegate image to image metric does this only at initialization.
-  MovingImageSourceOutputImagePointerType movingImage =
-    m_MovingImageSource->GetOutput();
   m_Interpolator->SetInputImage(movingImage);
 
   // Now we can set the moving image in the image to image metric.
@@ -177,7 +369,27 @@ ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
 
   // We have to initialize the delegate metric here to avoid an exception
   m_DelegateMetric->Initialize();
-  MeasureType value = m_DelegateMetric->GetValue(parameters);
+
+  return m_DelegateMetric->GetValue(parameters);
+}
+
+
+template <class TFixedImage, class TMovingImageSource>
+typename ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>::MeasureType
+ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
+::GetValue(const ParametersType& parameters) const
+{
+  // Send the parameters to the parametric image source.
+  std::cout << "Parameters: " << parameters << std::endl;
+  SetParameters(parameters);
+
+  // Now update the parametric image source over the region the metric
+  // compares.
+  this->SetMovingImageRequestedRegion();
+  m_MovingImageSource->Update();
+
+  MeasureType value =
+    this->EvaluateDelegateMetric(m_MovingImageSource->GetOutput(), parameters);
   std::cout << "Value: " << value << std::endl;
 
   return value;
@@ -283,6 +495,9 @@ ImageToParametricImageSourceMetric<TFixedImage,TMovingImageSource>
   os << indent << "Transform: " << m_Transform.GetPointer() << std::endl;
   os << indent << "Interpolator: " << m_Interpolator.GetPointer() << std::endl;
   os << indent << "ParametersMask: " << m_ParametersMask << std::endl;
+  os << indent << "DerivativeStep: " << m_DerivativeStep << std::endl;
+  os << indent << "FixedImageRegion: " << m_FixedImageRegion << std::endl;
+  os << indent << "FixedImageMask: " << m_FixedImageMask.GetPointer() << std::endl;
 }
 
 } // end namespace itk
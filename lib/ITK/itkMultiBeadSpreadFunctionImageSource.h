@@ -0,0 +1,323 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef _itkMultiBeadSpreadFunctionImageSource_h
+#define _itkMultiBeadSpreadFunctionImageSource_h
+
+#include "itkParametricImageSource.h"
+#include "itkSphereConvolutionFilter.h"
+#include "itkCommand.h"
+#include "itkMultiThreader.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <vector>
+
+namespace itk
+{
+
+/** \class MultiBeadSpreadFunctionImageSource
+ *
+ * \brief Generates a synthetic image of several beads, each the
+ * convolution of a sphere with the kernel of a ParametricImageSource.
+ *
+ * All beads share the kernel, bead radius, shear and background, while
+ * each bead has its own center and intensity scale. The kernel table
+ * and its scan are generated once per update and shared by one
+ * SphereConvolutionFilter per bead, so fitting the beads of a field of
+ * view jointly costs one kernel table instead of one per bead. Only
+ * the beads whose convolver is out of date are rendered again.
+ *
+ * Each bead is rendered into a region of interest of the output, the
+ * box of voxels within BeadRegionRadius of its center, and the output
+ * is the background plus the sum of the bead regions. A zero
+ * component of BeadRegionRadius extends the regions over the whole
+ * output along that dimension, so the default renders every bead into
+ * the whole output. Bead regions are cropped to the requested region
+ * of the output, which is all that is generated.
+ *
+ * Beads are convolved with the chord method. When at least as many
+ * beads are to be rendered as there are threads, the beads are
+ * distributed over the threads, each convolving whole beads;
+ * otherwise the beads are rendered one after the other and each
+ * convolver splits its bead among the threads.
+ *
+ * \ingroup DataSources Multithreaded
+*/
+template < class TOutputImage >
+class ITK_EXPORT MultiBeadSpreadFunctionImageSource :
+    public ParametricImageSource< TOutputImage >
+{
+public:
+  /** Standard class typedefs. */
+  typedef MultiBeadSpreadFunctionImageSource    Self;
+  typedef ParametricImageSource< TOutputImage > Superclass;
+  typedef SmartPointer< Self >                  Pointer;
+  typedef SmartPointer< const Self >            ConstPointer;
+
+  /** Typedef for output types. */
+  typedef TOutputImage                             OutputImageType;
+  typedef typename OutputImageType::Pointer        OutputImagePointer;
+  typedef typename OutputImageType::PixelType      PixelType;
+  typedef typename OutputImageType::RegionType     RegionType;
+  typedef typename OutputImageType::PointType      PointType;
+  typedef typename OutputImageType::PointValueType PointValueType;
+  typedef typename PointType::VectorType           VectorType;
+  typedef typename OutputImageType::SpacingType    SpacingType;
+  typedef typename OutputImageType::IndexType      IndexType;
+  typedef typename OutputImageType::SizeType       SizeType;
+  typedef typename OutputImageType::SizeValueType  SizeValueType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int,
+                      TOutputImage::ImageDimension);
+
+  typedef ParametricImageSource< TOutputImage >
+    KernelImageSourceType;
+  typedef typename KernelImageSourceType::Pointer
+    KernelImageSourcePointer;
+  typedef SphereConvolutionFilter< TOutputImage, TOutputImage >
+    ConvolverType;
+  typedef typename ConvolverType::Pointer
+    ConvolverPointer;
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(MultiBeadSpreadFunctionImageSource,ParametricImageSource);
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  typedef typename Superclass::ParametersValueType ParametersValueType;
+  typedef typename Superclass::ParametersType      ParametersType;
+  typedef typename Superclass::ParametersMaskType  ParametersMaskType;
+  typedef typename Superclass::JacobianType        JacobianType;
+
+  /** Set/get the number of beads. New beads are centered at the
+   * origin with unit intensity scale. */
+  void SetNumberOfBeads(unsigned int numberOfBeads);
+  unsigned int GetNumberOfBeads() const;
+
+  /** Set/get the center of a bead (in nanometers). */
+  void SetBeadCenter(unsigned int bead, const PointType & center);
+  const PointType & GetBeadCenter(unsigned int bead) const;
+
+  /** Set/get the intensity scale of a bead. */
+  void SetBeadIntensityScale(unsigned int bead, double scale);
+  double GetBeadIntensityScale(unsigned int bead) const;
+
+  /** Set/get the bead radius shared by all beads (in nanometers). */
+  itkSetMacro(BeadRadius, double);
+  itkGetConstMacro(BeadRadius, double);
+
+  /** Set/get the shear in the X direction. */
+  itkSetMacro(ShearX, double);
+  itkGetConstMacro(ShearX, double);
+
+  /** Set/get the shear in the Y direction. */
+  itkSetMacro(ShearY, double);
+  itkGetConstMacro(ShearY, double);
+
+  /** Set/get the background value. */
+  itkSetMacro(IntensityShift, double);
+  itkGetConstMacro(IntensityShift, double);
+
+  /** Set/get the half-widths of the region rendered around each bead
+   * center (in nanometers). Voxels outside the region of a bead get
+   * no contribution from it, so the half-widths should cover the
+   * kernel support that matters. A zero half-width renders the beads
+   * over the whole output along that dimension. Defaults to zero. */
+  itkSetMacro(BeadRegionRadius, VectorType);
+  itkGetConstReferenceMacro(BeadRegionRadius, VectorType);
+
+  /** Set/get the convolution kernel source. */
+  virtual void SetKernelSource( KernelImageSourceType* source );
+  itkGetObjectMacro(KernelSource, KernelImageSourceType);
+
+  /** Set/get kernel radial symmetry flag. If this flag is set to
+   * true, then only a single slice of the kernel corresponding to a
+   * radial profile of the kernel. */
+  itkSetMacro(KernelIsRadiallySymmetric, bool);
+  itkGetMacro(KernelIsRadiallySymmetric, bool);
+  itkBooleanMacro(KernelIsRadiallySymmetric);
+
+  /** Set/get the kernel table spacing (in nanometers). Defaults to
+   * 50. */
+  itkSetMacro(KernelTableSpacing, double);
+  itkGetConstMacro(KernelTableSpacing, double);
+
+  /** Set/get the margin added around the kernel table extent (in
+   * nanometers). As long as the kernel parameters are unchanged and
+   * the extent needed by all beads fits in the current table, the
+   * current table is reused. A new table is padded by this margin so
+   * that bead center steps up to the margin fit. See
+   * BeadSpreadFunctionImageSource. Defaults to zero. */
+  itkSetMacro(KernelTableMargin, double);
+  itkGetConstMacro(KernelTableMargin, double);
+
+  /** Set/get a single parameter value. */
+  virtual void SetParameter(unsigned int index, ParametersValueType value);
+  virtual ParametersValueType GetParameter(unsigned int index) const;
+
+  /** Expects the parameters argument to contain values for ALL
+   * parameters. The parameters are the spacing, bead radius, shear in
+   * X and Y and intensity shift, followed by the center and intensity
+   * scale of each bead, followed by the kernel parameters. */
+  virtual void SetParameters(const ParametersType& parameters);
+
+  /** Gets the full parameters list. */
+  virtual ParametersType GetParameters() const;
+
+  /** Gets the total number of parameters. */
+  virtual unsigned int GetNumberOfParameters() const;
+
+  /** Gets the number of bead-spread function parameters, which
+   * includes the parameters of every bead. */
+  virtual unsigned int GetNumberOfBeadSpreadFunctionParameters() const;
+
+  /** Gets the index of the first parameter of a bead, its center
+   * along x. The intensity scale follows the center. */
+  unsigned int GetBeadParameterIndex(unsigned int bead) const;
+
+  /** Generates the output image and its derivatives with respect to
+   * the parameters in the mask. The derivatives with respect to the
+   * intensity shift and the bead intensity scales follow from the
+   * bead regions. The derivatives with respect to the kernel
+   * parameters are the sums over the beads of the scaled convolutions
+   * of the kernel derivatives from the kernel source's
+   * GenerateJacobian(). The remaining derivatives are computed by
+   * central differences; those with respect to a bead center only
+   * render that bead again. */
+  virtual void GenerateJacobian(const ParametersMaskType& mask,
+                                JacobianType& jacobian);
+
+  /** Get the image a bead was rendered into in the last update. It
+   * covers the bead region and holds the bead scaled by its intensity
+   * scale, without the background. */
+  const OutputImageType* GetBeadOutput(unsigned int bead) const;
+
+  /** Get the region of the output a bead was rendered into in the
+   * last update. The region is empty if the bead lies too far outside
+   * the output. */
+  const RegionType & GetBeadRegion(unsigned int bead) const;
+
+  /** Get the number of updates that produced a new kernel table. */
+  itkGetConstMacro(NumberOfKernelUpdates, unsigned long);
+
+  /** Get the number of beads rendered over all updates. */
+  itkGetConstMacro(NumberOfBeadUpdates, unsigned long);
+
+  /** Callback evoked whenever the KernelSource is modified. */
+  virtual void KernelModified();
+
+protected:
+  MultiBeadSpreadFunctionImageSource();
+  virtual ~MultiBeadSpreadFunctionImageSource();
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+  /** The beads are rendered by the member convolvers, distributed
+   * over the threads by this class or by the convolvers themselves,
+   * so we go with a "single-threaded" implementation here. */
+  virtual void GenerateData();
+
+  /** Computes the part of the output requested region rendered for a
+   * bead center. */
+  RegionType ComputeBeadRegion(const PointType& center) const;
+
+  /** Computes the origin, spacing and size of the kernel table needed
+   * to cover the regions of all beads. */
+  void ComputeKernelTableGeometry(PointType& origin, SpacingType& spacing,
+                                  SizeType& size) const;
+
+  /** Returns whether the current kernel table covers a table of the
+   * given geometry. */
+  bool KernelTableCovers(const PointType& origin, const SpacingType& spacing,
+                         const SizeType& size) const;
+
+  /** Copies the shared bead settings and the region and center of a
+   * bead to a convolver. */
+  void ConfigureConvolver(ConvolverType* convolver, unsigned int bead) const;
+
+  /** Adds a bead image times a factor to the given region of the
+   * target image, clipped to the buffered region of the target. */
+  void AddBeadImage(OutputImageType* target, const OutputImageType* beadImage,
+                    const RegionType& region, double factor) const;
+
+  /** Renders the pending beads, each thread taking the next bead
+   * until none is left. */
+  static ITK_THREAD_RETURN_TYPE RenderBeadsCallback(void* arg);
+
+private:
+  MultiBeadSpreadFunctionImageSource(const MultiBeadSpreadFunctionImageSource&); // purposely not implemented
+  void operator=(const MultiBeadSpreadFunctionImageSource&); // purposely not implemented
+
+  double     m_BeadRadius;
+  double     m_ShearX;
+  double     m_ShearY;
+  double     m_IntensityShift; // Additive background constant
+  VectorType m_BeadRegionRadius;
+
+  /** Per-bead centers, intensity scales, convolvers and the regions
+   * they were rendered into. */
+  std::vector< PointType >        m_BeadCenters;
+  std::vector< double >           m_BeadIntensityScales;
+  std::vector< ConvolverPointer > m_BeadConvolvers;
+  std::vector< RegionType >       m_BeadRegions;
+
+  KernelImageSourcePointer  m_KernelSource;
+  bool                      m_KernelIsRadiallySymmetric;
+  double                    m_KernelTableSpacing;
+  double                    m_KernelTableMargin;
+
+  /** Geometry, parameters and modification time of the kernel table
+   * shared by the bead convolvers. */
+  PointType                 m_CurrentKernelTableOrigin;
+  SpacingType               m_CurrentKernelTableSpacing;
+  SizeType                  m_CurrentKernelTableSize;
+  std::vector< double >     m_KernelKey;
+  unsigned long             m_KernelSourceMTime;
+
+  /** Scans the kernel table once for all bead convolvers. */
+  typename ConvolverType::ScanImageFilterPointer m_KernelScanFilter;
+
+  /** Convolves kernel derivatives with the beads. */
+  ConvolverPointer          m_JacobianConvolver;
+
+  /** Beads left to render by the threads. */
+  std::vector< unsigned int > m_PendingBeads;
+  unsigned int                m_NextPendingBead;
+  SimpleFastMutexLock         m_PendingBeadsLock;
+
+  unsigned long m_NumberOfKernelUpdates;
+  unsigned long m_NumberOfBeadUpdates;
+
+  typedef SimpleMemberCommand< Self > MemberCommandType;
+  typedef typename MemberCommandType::Pointer MemberCommandPointer;
+  MemberCommandPointer m_ModifiedEventCommand;
+  unsigned long        m_ObserverTag;
+
+  /** Builds the key of the kernel table from the kernel parameters
+   * and the table geometry. */
+  std::vector< double > MakeKernelKey(const PointType& origin,
+                                      const SpacingType& spacing,
+                                      const SizeType& size) const;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkMultiBeadSpreadFunctionImageSource.txx"
+#endif
+
+#endif // _itkMultiBeadSpreadFunctionImageSource_h
@@ -0,0 +1,985 @@
+#ifndef _itkMultiBeadSpreadFunctionImageSource_txx
+#define _itkMultiBeadSpreadFunctionImageSource_txx
+
+#include "itkMultiBeadSpreadFunctionImageSource.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
+
+#include <algorithm>
+#include <cmath>
+
+
+namespace itk
+{
+
+template< class TOutputImage >
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::MultiBeadSpreadFunctionImageSource()
+{
+  m_BeadRadius     = 100.0;
+  m_ShearX         = 0.0;
+  m_ShearY         = 0.0;
+  m_IntensityShift = 0.0;
+  m_BeadRegionRadius.Fill(0.0);
+
+  m_KernelSource = NULL;
+  m_KernelIsRadiallySymmetric = false;
+  m_KernelTableSpacing = 50.0; // An arbitrary spacing
+  m_KernelTableMargin  = 0.0;
+  m_CurrentKernelTableOrigin.Fill(0.0);
+  m_CurrentKernelTableSpacing.Fill(0.0);
+  m_CurrentKernelTableSize.Fill(0);
+  m_KernelSourceMTime = 0;
+
+  m_KernelScanFilter = ConvolverType::ScanImageFilterType::New();
+  m_KernelScanFilter->SetScanDimension(2);
+  m_KernelScanFilter->SetScanOrderToIncreasing();
+  m_KernelScanFilter->UseBlockedScanOn();
+
+  m_JacobianConvolver = ConvolverType::New();
+
+  m_NextPendingBead = 0;
+
+  m_NumberOfKernelUpdates = 0;
+  m_NumberOfBeadUpdates   = 0;
+
+  m_ModifiedEventCommand = MemberCommandType::New();
+  m_ModifiedEventCommand->SetCallbackFunction(this, &Self::KernelModified);
+  m_ObserverTag = 0;
+}
+
+
+template< class TOutputImage >
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::~MultiBeadSpreadFunctionImageSource()
+{
+  if (this->m_KernelSource)
+    {
+    this->m_KernelSource->RemoveObserver(this->m_ObserverTag);
+    }
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::KernelModified()
+{
+  this->Modified();
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::SetKernelSource( KernelImageSourceType* source )
+{
+  if ( this->m_KernelSource != source )
+    {
+    if ( this->m_KernelSource )
+      {
+      this->m_KernelSource->RemoveObserver(this->m_ObserverTag);
+      }
+    this->m_KernelSource = source;
+    this->m_ObserverTag = this->m_KernelSource->
+      AddObserver(ModifiedEvent() , m_ModifiedEventCommand);
+    m_KernelKey.clear();
+    this->Modified();
+    }
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::SetNumberOfBeads(unsigned int numberOfBeads)
+{
+  if (numberOfBeads == m_BeadConvolvers.size())
+    {
+    return;
+    }
+
+  PointType origin;
+  origin.Fill(0.0);
+  m_BeadCenters.resize(numberOfBeads, origin);
+  m_BeadIntensityScales.resize(numberOfBeads, 1.0);
+  m_BeadRegions.resize(numberOfBeads);
+
+  unsigned int oldNumberOfBeads = m_BeadConvolvers.size();
+  m_BeadConvolvers.resize(numberOfBeads);
+  for (unsigned int b = oldNumberOfBeads; b < numberOfBeads; b++)
+    {
+    m_BeadConvolvers[b] = ConvolverType::New();
+
+    // Specify multiple integration samples in x and y but not z.
+    typename ConvolverType::SizeType voxelSamples = {{1, 1, 1}};
+    m_BeadConvolvers[b]->SetNumberOfIntegrationSamples(voxelSamples);
+    m_BeadConvolvers[b]->WeightIntegrationByAreaOn();
+    }
+
+  this->Modified();
+}
+
+
+template< class TOutputImage >
+unsigned int
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetNumberOfBeads() const
+{
+  return m_BeadConvolvers.size();
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::SetBeadCenter(unsigned int bead, const PointType& center)
+{
+  if (center != m_BeadCenters[bead])
+    {
+    m_BeadCenters[bead] = center;
+    this->Modified();
+    }
+}
+
+
+template< class TOutputImage >
+const typename MultiBeadSpreadFunctionImageSource< TOutputImage >::PointType&
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetBeadCenter(unsigned int bead) const
+{
+  return m_BeadCenters[bead];
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::SetBeadIntensityScale(unsigned int bead, double scale)
+{
+  if (scale != m_BeadIntensityScales[bead])
+    {
+    m_BeadIntensityScales[bead] = scale;
+    this->Modified();
+    }
+}
+
+
+template< class TOutputImage >
+double
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetBeadIntensityScale(unsigned int bead) const
+{
+  return m_BeadIntensityScales[bead];
+}
+
+
+template< class TOutputImage >
+const typename MultiBeadSpreadFunctionImageSource< TOutputImage >::OutputImageType*
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetBeadOutput(unsigned int bead) const
+{
+  return m_BeadConvolvers[bead]->GetOutput();
+}
+
+
+template< class TOutputImage >
+const typename MultiBeadSpreadFunctionImageSource< TOutputImage >::RegionType&
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetBeadRegion(unsigned int bead) const
+{
+  return m_BeadRegions[bead];
+}
+
+
+template< class TOutputImage >
+unsigned int
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetBeadParameterIndex(unsigned int bead) const
+{
+  return ImageDimension + 4 + bead * (ImageDimension + 1);
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::SetParameter(unsigned int index, ParametersValueType value)
+{
+  unsigned int numberOfSharedParameters = ImageDimension + 4;
+  unsigned int numberOfBSFParameters = this->GetNumberOfBeadSpreadFunctionParameters();
+  if (index < numberOfSharedParameters)
+    {
+    if (index < ImageDimension)
+      {
+      SpacingType spacing = this->GetSpacing();
+      spacing[index] = value;
+      this->SetSpacing(spacing);
+      return;
+      }
+
+    switch (index - ImageDimension)
+      {
+      case 0:
+        this->SetBeadRadius(value);
+        break;
+
+      case 1:
+        this->SetShearX(value);
+        break;
+
+      case 2:
+        this->SetShearY(value);
+        break;
+
+      case 3:
+        this->SetIntensityShift(value);
+        break;
+      }
+    }
+  else if (index < numberOfBSFParameters)
+    {
+    unsigned int bead   = (index - numberOfSharedParameters) / (ImageDimension + 1);
+    unsigned int offset = (index - numberOfSharedParameters) % (ImageDimension + 1);
+    if (offset < ImageDimension)
+      {
+      PointType center = m_BeadCenters[bead];
+      center[offset] = value;
+      this->SetBeadCenter(bead, center);
+      }
+    else
+      {
+      this->SetBeadIntensityScale(bead, value);
+      }
+    }
+  else
+    {
+    this->m_KernelSource->SetParameter(index - numberOfBSFParameters, value);
+    }
+}
+
+
+template< class TOutputImage >
+typename MultiBeadSpreadFunctionImageSource< TOutputImage >::ParametersValueType
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetParameter(unsigned int index) const
+{
+  unsigned int numberOfSharedParameters = ImageDimension + 4;
+  unsigned int numberOfBSFParameters = this->GetNumberOfBeadSpreadFunctionParameters();
+  if (index < numberOfSharedParameters)
+    {
+    if (index < ImageDimension)
+      {
+      return this->GetSpacing()[index];
+      }
+
+    switch (index - ImageDimension)
+      {
+      case 0:
+        return this->GetBeadRadius();
+        break;
+
+      case 1:
+        return this->GetShearX();
+        break;
+
+      case 2:
+        return this->GetShearY();
+        break;
+
+      case 3:
+        return this->GetIntensityShift();
+        break;
+
+      default:
+        return 999.0;
+      }
+    }
+  else if (index < numberOfBSFParameters)
+    {
+    unsigned int bead   = (index - numberOfSharedParameters) / (ImageDimension + 1);
+    unsigned int offset = (index - numberOfSharedParameters) % (ImageDimension + 1);
+    if (offset < ImageDimension)
+      {
+      return m_BeadCenters[bead][offset];
+      }
+    return m_BeadIntensityScales[bead];
+    }
+  else
+    {
+    return this->m_KernelSource->GetParameter(index - numberOfBSFParameters);
+    }
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::SetParameters(const ParametersType& parameters)
+{
+  int index = 0;
+
+  // The first parameters are shared by all beads
+  SpacingType spacing;
+  for (int i = 0; i < ImageDimension; i++)
+    {
+    spacing[i] = parameters[index++];
+    }
+  this->SetSpacing(spacing);
+
+  this->SetBeadRadius(parameters[index++]);
+  this->SetShearX(parameters[index++]);
+  this->SetShearY(parameters[index++]);
+  this->SetIntensityShift(parameters[index++]);
+
+  // Then come the parameters of each bead
+  for (unsigned int b = 0; b < this->GetNumberOfBeads(); b++)
+    {
+    PointType center;
+    for (int i = 0; i < ImageDimension; i++)
+      {
+      center[i] = parameters[index++];
+      }
+    this->SetBeadCenter(b, center);
+    this->SetBeadIntensityScale(b, parameters[index++]);
+    }
+
+  // The last parameters go to the kernel source
+  ParametersType kernelParameters(this->m_KernelSource->GetNumberOfParameters());
+  for (unsigned int i = 0; i < kernelParameters.GetSize(); i++)
+    {
+    kernelParameters[i] = parameters[index++];
+    }
+
+  this->m_KernelSource->SetParameters(kernelParameters);
+}
+
+
+template< class TOutputImage >
+typename MultiBeadSpreadFunctionImageSource< TOutputImage >::ParametersType
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetParameters() const
+{
+  ParametersType parameters(GetNumberOfParameters());
+  int index = 0;
+
+  // The first parameters are shared by all beads
+  const SpacingType spacing = this->GetSpacing();
+  for (int i = 0; i < ImageDimension; i++)
+    {
+    parameters[index++] = spacing[i];
+    }
+
+  parameters[index++] = this->GetBeadRadius();
+  parameters[index++] = this->GetShearX();
+  parameters[index++] = this->GetShearY();
+  parameters[index++] = this->GetIntensityShift();
+
+  // Then come the parameters of each bead
+  for (unsigned int b = 0; b < this->GetNumberOfBeads(); b++)
+    {
+    for (int i = 0; i < ImageDimension; i++)
+      {
+      parameters[index++] = m_BeadCenters[b][i];
+      }
+    parameters[index++] = m_BeadIntensityScales[b];
+    }
+
+  // The last parameters come from the kernel source
+  ParametersType kernelParameters = this->m_KernelSource->GetParameters();
+  for (unsigned int i = 0; i < kernelParameters.GetSize(); i++)
+    {
+    parameters[index++] = kernelParameters[i];
+    }
+
+  return parameters;
+}
+
+
+template< class TOutputImage >
+unsigned int
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetNumberOfParameters() const
+{
+  return this->m_KernelSource->GetNumberOfParameters() +
+    this->GetNumberOfBeadSpreadFunctionParameters();
+}
+
+
+template< class TOutputImage >
+unsigned int
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GetNumberOfBeadSpreadFunctionParameters() const
+{
+  return this->GetBeadParameterIndex(this->GetNumberOfBeads());
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GenerateJacobian(const ParametersMaskType& mask, JacobianType& jacobian)
+{
+  unsigned int numberOfParameters    = this->GetNumberOfParameters();
+  unsigned int numberOfBSFParameters = this->GetNumberOfBeadSpreadFunctionParameters();
+  unsigned int shiftIndex = ImageDimension + 3;
+
+  jacobian.assign(numberOfParameters, OutputImagePointer());
+
+  // Central differences for the parameters that change the geometry
+  // of the convolutions, and for the scales of beads with zero scale,
+  // whose unscaled convolution is not at hand. This also leaves the
+  // output up to date.
+  ParametersMaskType differenceMask(numberOfParameters);
+  differenceMask.Fill(0);
+  bool difference = false;
+  for (unsigned int i = 0; i < numberOfBSFParameters; i++)
+    {
+    if (!mask[i] || i == shiftIndex)
+      {
+      continue;
+      }
+    if (i >= this->GetBeadParameterIndex(0) &&
+        (i - this->GetBeadParameterIndex(0)) % (ImageDimension + 1) == ImageDimension &&
+        this->GetParameter(i) != 0.0)
+      {
+      continue;
+      }
+    differenceMask[i] = 1;
+    difference = true;
+    }
+
+  if (difference)
+    {
+    this->GenerateFiniteDifferenceJacobian(differenceMask, jacobian);
+    }
+  else
+    {
+    this->Update();
+    }
+
+  if (mask[shiftIndex])
+    {
+    jacobian[shiftIndex] = this->NewJacobianImage();
+    jacobian[shiftIndex]->FillBuffer(NumericTraits< PixelType >::One);
+    }
+
+  // The derivative with respect to the scale of a bead is its
+  // unscaled convolution.
+  for (unsigned int b = 0; b < this->GetNumberOfBeads(); b++)
+    {
+    unsigned int scaleIndex = this->GetBeadParameterIndex(b) + ImageDimension;
+    if (!mask[scaleIndex] || differenceMask[scaleIndex])
+      {
+      continue;
+      }
+
+    OutputImagePointer derivative = this->NewJacobianImage();
+    derivative->FillBuffer(NumericTraits< PixelType >::Zero);
+    if (m_BeadRegions[b].GetNumberOfPixels() > 0)
+      {
+      this->AddBeadImage(derivative, m_BeadConvolvers[b]->GetOutput(),
+                         m_BeadRegions[b], 1.0 / m_BeadIntensityScales[b]);
+      }
+    jacobian[scaleIndex] = derivative;
+    }
+
+  ParametersMaskType kernelMask(numberOfParameters - numberOfBSFParameters);
+  kernelMask.Fill(0);
+  bool differentiateKernel = false;
+  for (unsigned int i = 0; i < kernelMask.GetSize(); i++)
+    {
+    if (mask[numberOfBSFParameters + i])
+      {
+      kernelMask[i] = 1;
+      differentiateKernel = true;
+      }
+    }
+
+  if (!differentiateKernel)
+    {
+    return;
+    }
+
+  // The kernel source is left with the kernel table geometry set in
+  // the last update, so its derivatives are sampled like the table.
+  // Its requested region is the band of columns the last bead
+  // convolver looked up, while the beads together may look up any
+  // column, so the derivatives are generated over the whole table.
+  JacobianType kernelJacobian;
+  unsigned long kernelMTime = m_KernelSource->GetMTime();
+  m_KernelSource->GetOutput()->SetRequestedRegionToLargestPossibleRegion();
+  m_KernelSource->GenerateJacobian(kernelMask, kernelJacobian);
+
+  // The kernel source regenerates its output for the derivatives, but
+  // leaves its parameters as they were, so a current kernel table
+  // stays current and the beads need not be rendered again.
+  if (kernelMTime == m_KernelSourceMTime)
+    {
+    m_KernelSourceMTime = m_KernelSource->GetMTime();
+    }
+
+  for (unsigned int i = 0; i < kernelJacobian.size(); i++)
+    {
+    if (!kernelJacobian[i])
+      {
+      continue;
+      }
+
+    // Each bead convolution is linear in the kernel, so the derivative
+    // is the sum of the bead convolutions of the kernel derivative.
+    OutputImagePointer derivative = this->NewJacobianImage();
+    derivative->FillBuffer(NumericTraits< PixelType >::Zero);
+
+    m_JacobianConvolver->SetInput(kernelJacobian[i]);
+    for (unsigned int b = 0; b < this->GetNumberOfBeads(); b++)
+      {
+      if (m_BeadRegions[b].GetNumberOfPixels() == 0)
+        {
+        continue;
+        }
+
+      this->ConfigureConvolver(m_JacobianConvolver, b);
+      m_JacobianConvolver->UpdateLargestPossibleRegion();
+      this->AddBeadImage(derivative, m_JacobianConvolver->GetOutput(),
+                         m_BeadRegions[b], 1.0);
+      }
+    jacobian[numberOfBSFParameters + i] = derivative;
+    }
+
+  // Release the kernel derivatives.
+  m_JacobianConvolver->SetInput(NULL);
+}
+
+
+template< class TOutputImage >
+typename MultiBeadSpreadFunctionImageSource< TOutputImage >::RegionType
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::ComputeBeadRegion(const PointType& center) const
+{
+  // Only the requested region of the output is generated.
+  const RegionType& requestedRegion = this->GetOutput()->GetRequestedRegion();
+  IndexType index;
+  SizeType  size;
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    long first = requestedRegion.GetIndex()[i];
+    long last  = first + static_cast<long>(requestedRegion.GetSize()[i]) - 1;
+    if (m_BeadRegionRadius[i] > 0.0)
+      {
+      double spacing = this->GetSpacing()[i];
+      double origin  = this->GetOrigin()[i];
+      first = std::max(first, Math::Ceil<long>
+                       ((center[i] - m_BeadRegionRadius[i] - origin) / spacing));
+      last  = std::min(last, Math::Floor<long>
+                       ((center[i] + m_BeadRegionRadius[i] - origin) / spacing));
+      }
+
+    if (last < first)
+      {
+      return RegionType();
+      }
+    index[i] = first;
+    size[i]  = static_cast<SizeValueType>(last - first + 1);
+    }
+
+  return RegionType(index, size);
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::ComputeKernelTableGeometry(PointType& psfTableOrigin,
+                             SpacingType& psfTableSpacing,
+                             SizeType& psfTableSize) const
+{
+  psfTableSpacing.Fill(m_KernelTableSpacing);
+
+  // Determine the extent of the kernel table needed by the union of
+  // the bead regions, relative to their bead centers.
+  PointType minExtent;
+  PointType maxExtent;
+  minExtent.Fill(NumericTraits<PointValueType>::max());
+  maxExtent.Fill(NumericTraits<PointValueType>::NonpositiveMin());
+  double maxRadialDistance = 0.0;
+  for (unsigned int b = 0; b < this->GetNumberOfBeads(); b++)
+    {
+    const RegionType& region = m_BeadRegions[b];
+    if (region.GetNumberOfPixels() == 0)
+      {
+      continue;
+      }
+
+    PointType first;
+    PointType last;
+    for (unsigned int i = 0; i < ImageDimension; i++)
+      {
+      first[i] = this->GetOrigin()[i] - m_BeadCenters[b][i] +
+        static_cast<double>(region.GetIndex()[i]) * this->GetSpacing()[i];
+      last[i] = first[i] +
+        static_cast<double>(region.GetSize()[i] - 1) * this->GetSpacing()[i];
+      minExtent[i] = std::min(minExtent[i], first[i] - m_BeadRadius);
+      maxExtent[i] = std::max(maxExtent[i], last[i] + m_BeadRadius);
+      }
+
+    // Distance from the region corners to the bead center, projected
+    // to the xy-plane.
+    double x = std::max(fabs(first[0]), fabs(last[0])) + m_BeadRadius;
+    double y = std::max(fabs(first[1]), fabs(last[1])) + m_BeadRadius;
+    maxRadialDistance = std::max(maxRadialDistance, sqrt(x*x + y*y));
+    }
+
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    // Determine logical extent of the PSF table for the min and max extents.
+    long iDimMin = Math::Floor<long>(minExtent[i] / psfTableSpacing[i]);
+    psfTableOrigin[i] = static_cast<double>(iDimMin) * psfTableSpacing[i];
+    long iDimMax = Math::Ceil<long>(maxExtent[i] / psfTableSpacing[i]);
+
+    // Determine the logical extent of the PSF table in this dimension.
+    psfTableSize[i] = iDimMax - iDimMin + 1;
+    }
+
+  // Generate just a radial profile of the PSF if it is radially symmetric
+  if (this->m_KernelIsRadiallySymmetric)
+    {
+    psfTableOrigin[0] = 0.0;
+    psfTableOrigin[1] = 0.0;
+    long maxRadialSize = Math::Ceil<long>(maxRadialDistance / psfTableSpacing[0]);
+    psfTableSize[0] = maxRadialSize;
+    psfTableSize[1] = 1;
+    }
+}
+
+
+template< class TOutputImage >
+bool
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::KernelTableCovers(const PointType& origin, const SpacingType& spacing,
+                    const SizeType& size) const
+{
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    if (spacing[i] != m_CurrentKernelTableSpacing[i])
+      {
+      return false;
+      }
+
+    // Allow for rounding in the origin computation.
+    double tolerance = 1e-6 * spacing[i];
+    double first = m_CurrentKernelTableOrigin[i];
+    double last  = first + static_cast<double>(m_CurrentKernelTableSize[i] - 1) * spacing[i];
+    double neededFirst = origin[i];
+    double neededLast  = neededFirst + static_cast<double>(size[i] - 1) * spacing[i];
+    if (neededFirst < first - tolerance || neededLast > last + tolerance)
+      {
+      return false;
+      }
+    }
+
+  return true;
+}
+
+
+template< class TOutputImage >
+std::vector< double >
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::MakeKernelKey(const PointType& origin, const SpacingType& spacing,
+                const SizeType& size) const
+{
+  ParametersType kernelParameters = m_KernelSource->GetParameters();
+
+  std::vector< double > key;
+  key.reserve(kernelParameters.GetSize() + 3*ImageDimension);
+  for (unsigned int i = 0; i < kernelParameters.GetSize(); i++)
+    {
+    key.push_back(kernelParameters[i]);
+    }
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    key.push_back(origin[i]);
+    key.push_back(spacing[i]);
+    key.push_back(static_cast<double>(size[i]));
+    }
+
+  return key;
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::ConfigureConvolver(ConvolverType* convolver, unsigned int bead) const
+{
+  const RegionType& region = m_BeadRegions[bead];
+  PointType origin;
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    origin[i] = this->GetOrigin()[i] +
+      static_cast<double>(region.GetIndex()[i]) * this->GetSpacing()[i];
+    }
+
+  convolver->SetSize(region.GetSize());
+  convolver->SetSpacing(this->GetSpacing());
+  convolver->SetOrigin(origin);
+  convolver->SetSphereCenter(m_BeadCenters[bead]);
+  convolver->SetSphereRadius(m_BeadRadius);
+  convolver->SetShearX(m_ShearX);
+  convolver->SetShearY(m_ShearY);
+  convolver->SetOutputScale(m_BeadIntensityScales[bead]);
+  convolver->SetOutputShift(0.0);
+
+  if (convolver != m_BeadConvolvers[bead].GetPointer())
+    {
+    convolver->
+      SetNumberOfIntegrationSamples(m_BeadConvolvers[bead]->GetNumberOfIntegrationSamples());
+    convolver->
+      SetWeightIntegrationByArea(m_BeadConvolvers[bead]->GetWeightIntegrationByArea());
+    }
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::AddBeadImage(OutputImageType* target, const OutputImageType* beadImage,
+               const RegionType& region, double factor) const
+{
+  // The target may buffer less than the bead region, e.g., when the
+  // requested region shrank since the bead regions were computed.
+  RegionType targetRegion = region;
+  if (!targetRegion.Crop(target->GetBufferedRegion()))
+    {
+    return;
+    }
+
+  // The bead image starts at the corner of the bead region.
+  RegionType beadRegion = beadImage->GetBufferedRegion();
+  IndexType  beadIndex  = beadRegion.GetIndex();
+  for (unsigned int i = 0; i < ImageDimension; i++)
+    {
+    beadIndex[i] += targetRegion.GetIndex()[i] - region.GetIndex()[i];
+    }
+  beadRegion.SetIndex(beadIndex);
+  beadRegion.SetSize(targetRegion.GetSize());
+
+  ImageRegionConstIterator< OutputImageType > bit(beadImage, beadRegion);
+  ImageRegionIterator< OutputImageType > it(target, targetRegion);
+  for (; !it.IsAtEnd(); ++it, ++bit)
+    {
+    it.Set( static_cast< PixelType >(it.Get() + factor * bit.Get()) );
+    }
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::GenerateData()
+{
+  unsigned int numberOfBeads = this->GetNumberOfBeads();
+
+  // Beads too far outside the output have empty regions and are not
+  // rendered.
+  bool renderAny = false;
+  for (unsigned int b = 0; b < numberOfBeads; b++)
+    {
+    m_BeadRegions[b] = this->ComputeBeadRegion(m_BeadCenters[b]);
+    renderAny = renderAny || m_BeadRegions[b].GetNumberOfPixels() > 0;
+    }
+
+  // Kernel stage. The table covers the regions of all beads, so it is
+  // generated and scanned once for all of them.
+  bool kernelChanged = false;
+  if (renderAny)
+    {
+    PointType   psfTableOrigin;
+    SpacingType psfTableSpacing;
+    SizeType    psfTableSize;
+    this->ComputeKernelTableGeometry(psfTableOrigin, psfTableSpacing, psfTableSize);
+
+    bool reuseTable = !m_KernelKey.empty() &&
+      m_KernelSource->GetMTime() == m_KernelSourceMTime &&
+      this->KernelTableCovers(psfTableOrigin, psfTableSpacing, psfTableSize) &&
+      this->MakeKernelKey(m_CurrentKernelTableOrigin,
+                          m_CurrentKernelTableSpacing,
+                          m_CurrentKernelTableSize) == m_KernelKey;
+    if (reuseTable)
+      {
+      psfTableOrigin = m_CurrentKernelTableOrigin;
+      psfTableSize   = m_CurrentKernelTableSize;
+      }
+    else if (m_KernelTableMargin > 0.0)
+      {
+      for (unsigned int i = 0; i < ImageDimension; i++)
+        {
+        if (psfTableSize[i] == 1 && m_KernelIsRadiallySymmetric)
+          {
+          continue;
+          }
+        long margin = Math::Ceil<long>(m_KernelTableMargin / psfTableSpacing[i]);
+        if (!m_KernelIsRadiallySymmetric || i == 2)
+          {
+          psfTableOrigin[i] -= static_cast<double>(margin) * psfTableSpacing[i];
+          psfTableSize[i] += margin;
+          }
+        psfTableSize[i] += margin;
+        }
+      }
+    m_CurrentKernelTableOrigin  = psfTableOrigin;
+    m_CurrentKernelTableSpacing = psfTableSpacing;
+    m_CurrentKernelTableSize    = psfTableSize;
+
+    m_KernelSource->SetSize(psfTableSize);
+    m_KernelSource->SetSpacing(psfTableSpacing);
+    m_KernelSource->SetOrigin(psfTableOrigin);
+
+    std::vector< double > key =
+      this->MakeKernelKey(psfTableOrigin, psfTableSpacing, psfTableSize);
+    kernelChanged = key != m_KernelKey ||
+      m_KernelSource->GetMTime() != m_KernelSourceMTime;
+    if (kernelChanged)
+      {
+      m_KernelSource->UpdateLargestPossibleRegion();
+      m_KernelScanFilter->SetInput(m_KernelSource->GetOutput());
+      m_KernelScanFilter->UpdateLargestPossibleRegion();
+
+      m_KernelKey = key;
+      m_KernelSourceMTime = m_KernelSource->GetMTime();
+      m_NumberOfKernelUpdates++;
+      }
+    }
+
+  // Convolution stage. A bead is rendered again if the kernel changed
+  // or if its convolver was modified by a change of its region, its
+  // center, its scale or the shared bead settings.
+  m_PendingBeads.clear();
+  for (unsigned int b = 0; b < numberOfBeads; b++)
+    {
+    if (m_BeadRegions[b].GetNumberOfPixels() == 0)
+      {
+      continue;
+      }
+
+    ConvolverType* convolver = m_BeadConvolvers[b];
+    this->ConfigureConvolver(convolver, b);
+    convolver->SetInput(m_KernelSource->GetOutput());
+    convolver->SetScannedKernel(m_KernelScanFilter->GetOutput());
+    if (kernelChanged ||
+        convolver->GetMTime() > convolver->GetOutput()->GetUpdateMTime())
+      {
+      m_PendingBeads.push_back(b);
+      }
+    }
+
+  // With enough beads to go around, each thread renders whole beads.
+  // The pipeline requests are propagated here, before the threads
+  // start, because they write to the kernel table the convolvers share.
+  int numberOfThreads = this->GetNumberOfThreads();
+  bool threadAcrossBeads = numberOfThreads > 1 &&
+    m_PendingBeads.size() >= static_cast<unsigned int>(numberOfThreads);
+  for (unsigned int p = 0; p < m_PendingBeads.size(); p++)
+    {
+    ConvolverType* convolver = m_BeadConvolvers[m_PendingBeads[p]];
+    convolver->SetNumberOfThreads(threadAcrossBeads ? 1 : numberOfThreads);
+    if (threadAcrossBeads)
+      {
+      convolver->UpdateOutputInformation();
+      convolver->GetOutput()->SetRequestedRegionToLargestPossibleRegion();
+      convolver->GetOutput()->PropagateRequestedRegion();
+      }
+    else
+      {
+      convolver->UpdateLargestPossibleRegion();
+      }
+    }
+
+  if (threadAcrossBeads)
+    {
+    m_NextPendingBead = 0;
+    this->GetMultiThreader()->SetNumberOfThreads(numberOfThreads);
+    this->GetMultiThreader()->SetSingleMethod(this->RenderBeadsCallback, this);
+    this->GetMultiThreader()->SingleMethodExecute();
+    }
+  m_NumberOfBeadUpdates += m_PendingBeads.size();
+
+  // Sum the bead regions over the background.
+  OutputImageType* output = this->GetOutput();
+  output->SetBufferedRegion(output->GetRequestedRegion());
+  output->Allocate();
+  output->FillBuffer(static_cast< PixelType >(m_IntensityShift));
+  for (unsigned int b = 0; b < numberOfBeads; b++)
+    {
+    if (m_BeadRegions[b].GetNumberOfPixels() > 0)
+      {
+      this->AddBeadImage(output, m_BeadConvolvers[b]->GetOutput(),
+                         m_BeadRegions[b], 1.0);
+      }
+    }
+}
+
+
+template< class TOutputImage >
+ITK_THREAD_RETURN_TYPE
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::RenderBeadsCallback(void* arg)
+{
+  MultiThreader::ThreadInfoStruct* info =
+    static_cast<MultiThreader::ThreadInfoStruct*>(arg);
+  Self* source = static_cast<Self*>(info->UserData);
+
+  // Beads differ in cost with the size of their regions, so the
+  // threads take the next bead as they finish one.
+  while (true)
+    {
+    source->m_PendingBeadsLock.Lock();
+    unsigned int next = source->m_NextPendingBead++;
+    source->m_PendingBeadsLock.Unlock();
+
+    if (next >= source->m_PendingBeads.size())
+      {
+      break;
+      }
+
+    unsigned int bead = source->m_PendingBeads[next];
+    source->m_BeadConvolvers[bead]->GetOutput()->UpdateOutputData();
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
+template< class TOutputImage >
+void
+MultiBeadSpreadFunctionImageSource< TOutputImage >
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os,indent);
+  os << indent << "NumberOfBeads: " << this->GetNumberOfBeads() << std::endl;
+  for (unsigned int b = 0; b < this->GetNumberOfBeads(); b++)
+    {
+    os << indent << "Bead " << b << ": Center: " << m_BeadCenters[b]
+       << " IntensityScale: " << m_BeadIntensityScales[b] << std::endl;
+    }
+  os << indent << "BeadRadius: " << m_BeadRadius << std::endl;
+  os << indent << "ShearX: " << m_ShearX << std::endl;
+  os << indent << "ShearY: " << m_ShearY << std::endl;
+  os << indent << "IntensityShift: " << m_IntensityShift << std::endl;
+  os << indent << "BeadRegionRadius: " << m_BeadRegionRadius << std::endl;
+  os << indent << "KernelIsRadiallySymmetric: " << m_KernelIsRadiallySymmetric
+     << std::endl;
+  os << indent << "KernelTableSpacing: " << m_KernelTableSpacing << std::endl;
+  os << indent << "KernelTableMargin: " << m_KernelTableMargin << std::endl;
+  os << indent << "NumberOfKernelUpdates: " << m_NumberOfKernelUpdates << std::endl;
+  os << indent << "NumberOfBeadUpdates: " << m_NumberOfBeadUpdates << std::endl;
+  if (m_KernelSource)
+    {
+    m_KernelSource->Print(os,indent);
+    }
+}
+
+
+} // end namespace itk
+
+#endif // _itkMultiBeadSpreadFunctionImageSource_txx
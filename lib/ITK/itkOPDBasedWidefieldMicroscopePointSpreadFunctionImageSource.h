@@ -19,6 +19,7 @@
 #define __itkOPDBasedWidefieldMicroscopePointSpreadFunctionImageSource_h
 
 #include <complex>
+#include <vector>
 
 #include "itkWidefieldMicroscopePointSpreadFunctionImageSource.h"
 
@@ -123,11 +124,51 @@ public:
   /** Get the actual point source depth in the specimen layer (in nanometers). */
   itkGetConstMacro(ActualPointSourceDepthInSpecimenLayer, double);
 
+  /** Set/get the number m of Simpson subdivision pairs used to
+   *  integrate over the back focal plane aperture. The integrand is
+   *  evaluated at 2*m+1 points. */
+  itkSetMacro(NumberOfIntegrationSubdivisions, int);
+  itkGetConstMacro(NumberOfIntegrationSubdivisions, int);
+
+  /** Set/get whether the parts of the optical path difference that do
+   *  not depend on the voxel position are tabulated once per update at
+   *  the quadrature nodes instead of recomputed for every voxel. */
+  itkSetMacro(UsePrecomputedOPDTable, bool);
+  itkGetConstMacro(UsePrecomputedOPDTable, bool);
+  itkBooleanMacro(UsePrecomputedOPDTable);
+
+  /** Set/get the relative tolerance of adaptive integration over the
+   *  back focal plane aperture. When positive, each sample is
+   *  integrated by adaptive Simpson quadrature, which halves an
+   *  interval until its estimated error falls below its share of the
+   *  tolerance times the integral of the magnitude of the integrand.
+   *  Work is then spent only where the integrand oscillates, e.g.,
+   *  far from focus. When zero, the fixed Simpson rule with
+   *  NumberOfIntegrationSubdivisions is used. Defaults to zero. */
+  itkSetMacro(IntegrationRelativeTolerance, double);
+  itkGetConstMacro(IntegrationRelativeTolerance, double);
+
+  /** Set/get the maximum number of times adaptive integration halves
+   *  an interval. Defaults to 16. */
+  itkSetMacro(MaximumIntegrationDepth, int);
+  itkGetConstMacro(MaximumIntegrationDepth, int);
+
+  /** Get the number of integrand evaluations made by quadrature
+   *  during the last update. Sources that evaluate the integrand
+   *  without per-sample quadrature do not add to this count. */
+  itkGetConstMacro(NumberOfIntegrandEvaluations, unsigned long);
+
 protected:
   OPDBasedWidefieldMicroscopePointSpreadFunctionImageSource();
   ~OPDBasedWidefieldMicroscopePointSpreadFunctionImageSource();
   void PrintSelf(std::ostream& os, Indent indent) const;
 
+  /** Reset the integrand evaluation counts before generating data. */
+  void BeforeThreadedGenerateData();
+
+  /** Sum the integrand evaluation counts of all threads. */
+  void AfterThreadedGenerateData();
+
   /** Integrates a one-dimensional complex-valued function defined by
    *  a functor from a to b using 2*m+1 subdivisions. */
   template< class TFunctor >
@@ -161,6 +202,89 @@ protected:
     return sum;
   }
 
+  /** Integrates a one-dimensional complex-valued function defined by
+   *  a functor from a to b by adaptive Simpson quadrature with the
+   *  relative tolerance IntegrationRelativeTolerance. The number of
+   *  integrand evaluations is added to evaluations. */
+  template< class TFunctor >
+  ComplexType IntegrateAdaptive(const TFunctor& functor, double a, double b,
+                                double x, double y, double z,
+                                unsigned long& evaluations)
+  {
+    // Start from a few uniform panels so that the first error
+    // estimates are not fooled by the oscillation of the integrand.
+    const int numberOfPanels = 4;
+    const int n = 2*numberOfPanels + 1;
+    double h = (b - a) / static_cast<double>(n-1);
+
+    double r = sqrt(x*x + y*y);
+
+    ComplexType f[n];
+    double magnitude = 0.0;
+    for (int k = 0; k < n; k++)
+      {
+      f[k] = functor(r, z, a + k*h);
+      double weight = (k == 0 || k == n-1) ? 1.0 : ((k % 2) ? 4.0 : 2.0);
+      magnitude += weight * abs(f[k]);
+      }
+    magnitude *= h / 3.0;
+    evaluations += n;
+
+    double tolerance = m_IntegrationRelativeTolerance * magnitude /
+      static_cast<double>(numberOfPanels);
+
+    ComplexType sum(0.0, 0.0);
+    for (int p = 0; p < numberOfPanels; p++)
+      {
+      double left  = a + (2*p)*h;
+      double right = a + (2*p+2)*h;
+      ComplexType whole = (h / 3.0) * (f[2*p] + 4.0*f[2*p+1] + f[2*p+2]);
+      sum += AdaptiveSimpsonStep(functor, r, z, left, right,
+                                 f[2*p], f[2*p+1], f[2*p+2], whole,
+                                 tolerance, m_MaximumIntegrationDepth,
+                                 evaluations);
+      }
+
+    return sum;
+  }
+
+  /** Recursive step of adaptive Simpson quadrature on [a,b] given the
+   *  integrand values at both ends and the midpoint, and the Simpson
+   *  estimate over the whole interval. */
+  template< class TFunctor >
+  ComplexType AdaptiveSimpsonStep(const TFunctor& functor, double r, double z,
+                                  double a, double b, const ComplexType& fa,
+                                  const ComplexType& fm, const ComplexType& fb,
+                                  const ComplexType& whole, double tolerance,
+                                  int depth, unsigned long& evaluations)
+  {
+    double m = 0.5 * (a + b);
+    double h = b - a;
+    ComplexType flm = functor(r, z, 0.5 * (a + m));
+    ComplexType frm = functor(r, z, 0.5 * (m + b));
+    evaluations += 2;
+
+    ComplexType left  = (h / 12.0) * (fa + 4.0*flm + fm);
+    ComplexType right = (h / 12.0) * (fm + 4.0*frm + fb);
+    ComplexType delta = left + right - whole;
+
+    // Richardson extrapolation of the two estimates.
+    if (depth <= 0 || abs(delta) <= 15.0 * tolerance)
+      {
+      return left + right + delta / 15.0;
+      }
+
+    return
+      AdaptiveSimpsonStep(functor, r, z, a, m, fa, flm, fm, left,
+                          0.5 * tolerance, depth-1, evaluations) +
+      AdaptiveSimpsonStep(functor, r, z, m, b, fm, frm, fb, right,
+                          0.5 * tolerance, depth-1, evaluations);
+  }
+
+  /** Number of integrand evaluations made by each thread. Threads
+   *  should add their counts once per region rather than per sample. */
+  std::vector<unsigned long> m_IntegrandEvaluationsPerThread;
+
   double m_DesignCoverSlipRefractiveIndex;
   double m_ActualCoverSlipRefractiveIndex;
   double m_DesignCoverSlipThickness;
@@ -172,6 +296,13 @@ protected:
   double m_ActualSpecimenLayerRefractiveIndex;
   double m_ActualPointSourceDepthInSpecimenLayer;
 
+  int    m_NumberOfIntegrationSubdivisions;
+  bool   m_UsePrecomputedOPDTable;
+  double m_IntegrationRelativeTolerance;
+  int    m_MaximumIntegrationDepth;
+
+  unsigned long m_NumberOfIntegrandEvaluations;
+
 };
 } // end namespace itk
 
@@ -23,6 +23,12 @@ OPDBasedWidefieldMicroscopePointSpreadFunctionImageSource< TOutputImage >
   this->m_DesignSpecimenLayerRefractiveIndex         =  1.33; // unitless
   this->m_ActualSpecimenLayerRefractiveIndex         =  1.33; // unitless
   this->m_ActualPointSourceDepthInSpecimenLayer      =   0.0; // in micrometers
+
+  this->m_NumberOfIntegrationSubdivisions = 20;
+  this->m_UsePrecomputedOPDTable          = true;
+  this->m_IntegrationRelativeTolerance    = 0.0;
+  this->m_MaximumIntegrationDepth         = 16;
+  this->m_NumberOfIntegrandEvaluations    = 0;
 }
 
 
@@ -60,6 +66,38 @@ OPDBasedWidefieldMicroscopePointSpreadFunctionImageSource< TOutputImage >
             << m_ActualSpecimenLayerRefractiveIndex << std::endl;
   std::cout << indent << "ActualPointSourceDepthInSpecimenLayer: "
             << m_ActualPointSourceDepthInSpecimenLayer << std::endl;
+  std::cout << indent << "NumberOfIntegrationSubdivisions: "
+            << m_NumberOfIntegrationSubdivisions << std::endl;
+  std::cout << indent << "UsePrecomputedOPDTable: "
+            << m_UsePrecomputedOPDTable << std::endl;
+  std::cout << indent << "IntegrationRelativeTolerance: "
+            << m_IntegrationRelativeTolerance << std::endl;
+  std::cout << indent << "MaximumIntegrationDepth: "
+            << m_MaximumIntegrationDepth << std::endl;
+  std::cout << indent << "NumberOfIntegrandEvaluations: "
+            << m_NumberOfIntegrandEvaluations << std::endl;
+}
+
+
+template< class TOutputImage >
+void
+OPDBasedWidefieldMicroscopePointSpreadFunctionImageSource< TOutputImage >
+::BeforeThreadedGenerateData()
+{
+  m_IntegrandEvaluationsPerThread.assign(this->GetNumberOfThreads(), 0);
+}
+
+
+template< class TOutputImage >
+void
+OPDBasedWidefieldMicroscopePointSpreadFunctionImageSource< TOutputImage >
+::AfterThreadedGenerateData()
+{
+  m_NumberOfIntegrandEvaluations = 0;
+  for (unsigned int i = 0; i < m_IntegrandEvaluationsPerThread.size(); i++)
+    {
+    m_NumberOfIntegrandEvaluations += m_IntegrandEvaluationsPerThread[i];
+    }
 }
 
 } // end namespace itk
@@ -19,6 +19,7 @@
 #define __itkOPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand_h
 
 #include <complex>
+#include <vector>
 
 namespace itk
 {
@@ -41,6 +42,18 @@ public:
   template< class TSource >
   void CopySettings(const TSource* source);
 
+  /** Precomputes the 2*m+1 Simpson quadrature nodes and weights on
+   *  [a, b] together with the parts of the optical path difference
+   *  that depend only on rho. Must be called after CopySettings(). */
+  void PrecomputeOPDTable(double a, double b, int m);
+
+  /** Computes the derivative of the optical path difference with
+   *  respect to one of the model parameters below, numbered in the
+   *  order they are declared. Thicknesses are taken in micrometers.
+   *  Parameters that do not enter the optical path difference have
+   *  zero derivative. */
+  ComplexType OPDDerivative(double rho, double dz, unsigned int parameter) const;
+
   /** Point-spread function model parameters. */
   double    m_EmissionWavelength;
   double    m_NumericalAperture;
@@ -61,16 +74,38 @@ public:
   double m_A; // Radius of projection of the limiting aperture onto
               // the back focal plane of the objective lens
 
+  /** Quadrature nodes, weights, and OPD terms at each node. The OPD at
+   *  node i is m_OPDConstantTable[i] + dz * m_OPDDefocusTable[i]. */
+  std::vector<double>      m_RhoTable;
+  std::vector<double>      m_WeightTable;
+  std::vector<ComplexType> m_OPDConstantTable;
+  std::vector<ComplexType> m_OPDDefocusTable;
+
 protected:
   /** Computes the optical path difference for a ray terminating at
   *   a normalized distance rho from the center of the back focal
   *   plane aperture. */
   ComplexType OPD(double rho, double dz) const;
 
+  /** Coefficient of the defocus distance dz in the optical path
+   *  difference. */
+  ComplexType OPDDefocusCoefficient(double rho) const;
+
+  /** Terms of the optical path difference that do not depend on the
+   *  defocus distance. */
+  ComplexType OPDConstant(double rho) const;
+
   /** Common terms for computing the optical path difference term in
    *  point-spread function models descended from this class. */
   ComplexType OPDTerm(double rho, double n, double t) const;
 
+  /** Derivatives of OPDTerm() with respect to n, t, the actual
+   *  immersion oil refractive index, and the numerical aperture. */
+  ComplexType OPDTermDerivativeN(double rho, double n, double t) const;
+  ComplexType OPDTermDerivativeT(double rho, double n) const;
+  ComplexType OPDTermDerivativeOilN(double rho, double n, double t) const;
+  ComplexType OPDTermDerivativeNA(double rho, double n, double t) const;
+
 };
 
 } // end namespace Functor
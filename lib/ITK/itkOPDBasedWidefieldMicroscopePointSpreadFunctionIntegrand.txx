@@ -67,14 +67,61 @@ OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
 }
 
 
+inline
+void
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::PrecomputeOPDTable(double a, double b, int m)
+{
+  int n = 2*m + 1;
+  double h = (b - a) / static_cast<double>(n-1);
+
+  this->m_RhoTable.resize(n);
+  this->m_WeightTable.resize(n);
+  this->m_OPDConstantTable.resize(n);
+  this->m_OPDDefocusTable.resize(n);
+
+  for (int i = 0; i < n; i++)
+    {
+    double rho = a + static_cast<double>(i)*h;
+
+    // Simpson weights are 1, 4, 2, 4, ..., 2, 4, 1 times h/3.
+    double weight = (i == 0 || i == n-1) ? 1.0 : ((i % 2) ? 4.0 : 2.0);
+
+    this->m_RhoTable[i]         = rho;
+    this->m_WeightTable[i]      = weight * h / 3.0;
+    this->m_OPDConstantTable[i] = this->OPDConstant(rho);
+    this->m_OPDDefocusTable[i]  = this->OPDDefocusCoefficient(rho);
+    }
+}
+
+
 inline
 OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
 OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
 ::OPD(double rho, double dz) const
 {
-  double NA      = this->m_NumericalAperture;
+  return dz * this->OPDDefocusCoefficient(rho) + this->OPDConstant(rho);
+}
+
+
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDDefocusCoefficient(double rho) const
+{
+  double NA    = this->m_NumericalAperture;
+  double n_oil = this->m_ActualImmersionOilRefractiveIndex;
+
+  return ComplexType(n_oil * sqrt(1.0 - ((NA*NA*rho*rho)/(n_oil*n_oil))));
+}
+
+
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDConstant(double rho) const
+{
   double n_oil_d = this->m_DesignImmersionOilRefractiveIndex;
-  double n_oil   = this->m_ActualImmersionOilRefractiveIndex;
   double t_oil_d = this->m_DesignImmersionOilThickness * 1e-6;
   double n_s     = this->m_ActualSpecimenLayerRefractiveIndex;
   double t_s     = this->m_ActualPointSourceDepthInSpecimenLayer * 1e-6;
@@ -88,10 +135,7 @@ OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
   ComplexType t3 = this->OPDTerm(rho, n_g_d,   t_g_d);
   ComplexType t4 = this->OPDTerm(rho, n_oil_d, t_oil_d);
 
-  ComplexType c1 = n_oil * dz * sqrt(1.0 - ((NA*NA*rho*rho)/(n_oil*n_oil)));
-  ComplexType result = c1 + t1 + t2 - t3 - t4;
-
-  return result;
+  return t1 + t2 - t3 - t4;
 }
 
 
@@ -118,6 +162,127 @@ OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
 }
 
 
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDDerivative(double rho, double dz, unsigned int parameter) const
+{
+  double NA      = this->m_NumericalAperture;
+  double n_oil   = this->m_ActualImmersionOilRefractiveIndex;
+  double n_oil_d = this->m_DesignImmersionOilRefractiveIndex;
+  double t_oil_d = this->m_DesignImmersionOilThickness * 1e-6;
+  double n_s     = this->m_ActualSpecimenLayerRefractiveIndex;
+  double t_s     = this->m_ActualPointSourceDepthInSpecimenLayer * 1e-6;
+  double n_g_d   = this->m_DesignCoverSlipRefractiveIndex;
+  double n_g     = this->m_ActualCoverSlipRefractiveIndex;
+  double t_g_d   = this->m_DesignCoverSlipThickness * 1e-6;
+  double t_g     = this->m_ActualCoverSlipThickness * 1e-6;
+
+  // The defocus coefficient is sqrt(n_oil^2 - NA^2 rho^2).
+  ComplexType sq(1.0 - (NA*NA*rho*rho)/(n_oil*n_oil));
+  sq = sqrt(sq);
+
+  switch (parameter)
+    {
+    case 1: // Numerical aperture
+      return -dz * NA * rho * rho / (n_oil * sq) +
+        this->OPDTermDerivativeNA(rho, n_s,     t_s) +
+        this->OPDTermDerivativeNA(rho, n_g,     t_g) -
+        this->OPDTermDerivativeNA(rho, n_g_d,   t_g_d) -
+        this->OPDTermDerivativeNA(rho, n_oil_d, t_oil_d);
+
+    case 3: // Design cover slip refractive index
+      return -this->OPDTermDerivativeN(rho, n_g_d, t_g_d);
+
+    case 4: // Actual cover slip refractive index
+      return this->OPDTermDerivativeN(rho, n_g, t_g);
+
+    case 5: // Design cover slip thickness
+      return -this->OPDTermDerivativeT(rho, n_g_d) * 1e-6;
+
+    case 6: // Actual cover slip thickness
+      return this->OPDTermDerivativeT(rho, n_g) * 1e-6;
+
+    case 7: // Design immersion oil refractive index
+      return -this->OPDTermDerivativeN(rho, n_oil_d, t_oil_d);
+
+    case 8: // Actual immersion oil refractive index
+      return dz / sq +
+        this->OPDTermDerivativeOilN(rho, n_s,     t_s) +
+        this->OPDTermDerivativeOilN(rho, n_g,     t_g) -
+        this->OPDTermDerivativeOilN(rho, n_g_d,   t_g_d) -
+        this->OPDTermDerivativeOilN(rho, n_oil_d, t_oil_d);
+
+    case 9: // Design immersion oil thickness
+      return -this->OPDTermDerivativeT(rho, n_oil_d) * 1e-6;
+
+    case 11: // Actual specimen layer refractive index
+      return this->OPDTermDerivativeN(rho, n_s, t_s);
+
+    case 12: // Actual point source depth in specimen layer
+      return this->OPDTermDerivativeT(rho, n_s) * 1e-6;
+
+    default:
+      return ComplexType(0.0);
+    }
+}
+
+
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDTermDerivativeN(double rho, double n, double t) const
+{
+  double NA    = this->m_NumericalAperture;
+  double n_oil = this->m_ActualImmersionOilRefractiveIndex;
+  double NA_rho_sq = NA*NA*rho*rho;
+
+  ComplexType sq1 = sqrt(ComplexType(1.0 - NA_rho_sq/(n*n)));
+  ComplexType sq2 = sqrt(ComplexType(1.0 - NA_rho_sq/(n_oil*n_oil)));
+
+  return t*(1.0/sq1 + ((n_oil*n_oil)/(n*n))*sq2);
+}
+
+
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDTermDerivativeT(double rho, double n) const
+{
+  return this->OPDTerm(rho, n, 1.0);
+}
+
+
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDTermDerivativeOilN(double rho, double n, double t) const
+{
+  double NA    = this->m_NumericalAperture;
+  double n_oil = this->m_ActualImmersionOilRefractiveIndex;
+
+  ComplexType sq2 = sqrt(ComplexType(1.0 - (NA*NA*rho*rho)/(n_oil*n_oil)));
+
+  return -(t*n_oil/n)*(sq2 + 1.0/sq2);
+}
+
+
+inline
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand::ComplexType
+OPDBasedWidefieldMicroscopePointSpreadFunctionIntegrand
+::OPDTermDerivativeNA(double rho, double n, double t) const
+{
+  double NA    = this->m_NumericalAperture;
+  double n_oil = this->m_ActualImmersionOilRefractiveIndex;
+  double NA_rho_sq = NA*NA*rho*rho;
+
+  ComplexType sq1 = sqrt(ComplexType(1.0 - NA_rho_sq/(n*n)));
+  ComplexType sq2 = sqrt(ComplexType(1.0 - NA_rho_sq/(n_oil*n_oil)));
+
+  return (t*NA*rho*rho/n)*(1.0/sq2 - 1.0/sq1);
+}
+
+
 } // end namespace Functor
 
 } // end namespace itk
@@ -22,6 +22,8 @@
 #include "itkAffineTransform.h"
 #include "itkImageSource.h"
 
+#include <vector>
+
 namespace itk
 {
 
@@ -64,6 +66,11 @@ public:
 
   typedef double                                   ParametersValueType;
   typedef Array< ParametersValueType >             ParametersType;
+  typedef Array< unsigned int >                    ParametersMaskType;
+
+  /** Derivatives of the output image with respect to the parameters,
+   * one image per parameter. */
+  typedef std::vector< OutputImagePointer >        JacobianType;
 
    /** ImageDimension constant */
   itkStaticConstMacro(OutputImageDimension,
@@ -98,6 +105,26 @@ public:
   virtual ParametersType GetParameters() const = 0;
   virtual unsigned int   GetNumberOfParameters() const = 0;
 
+  /** Generates the output image together with its derivatives with
+   * respect to the parameters whose entries in the mask are
+   * nonzero. Only the requested region of the output is generated,
+   * so set it beforehand to restrict the computation. On return, the
+   * jacobian holds one image with the geometry of the output and
+   * buffering its requested region for each parameter in the mask and
+   * a null pointer for every other parameter. The default
+   * implementation uses central differences, which regenerate the
+   * output twice per parameter. Subclasses override it to compute the
+   * derivatives analytically where they can. */
+  virtual void GenerateJacobian(const ParametersMaskType& mask,
+                                JacobianType& jacobian);
+
+  /** Set/get the step of the central differences used for the
+   * derivatives that are not computed analytically, relative to the
+   * magnitude of the parameter. The step is absolute for parameters
+   * that are zero. Defaults to 1e-4. */
+  itkSetMacro(FiniteDifferenceStep, double);
+  itkGetConstMacro(FiniteDifferenceStep, double);
+
 protected:
   ParametricImageSource();
   virtual ~ParametricImageSource() {}
@@ -110,6 +137,20 @@ protected:
 
   virtual void GenerateOutputInformation();
 
+  /** Computes the derivatives with respect to the parameters in the
+   * mask by central differences over the requested region of the
+   * output. The jacobian is resized to the number of parameters,
+   * entries for parameters outside the mask are left as they are, and
+   * the output is regenerated for the current parameters. */
+  void GenerateFiniteDifferenceJacobian(const ParametersMaskType& mask,
+                                        JacobianType& jacobian);
+
+  /** Allocates an image with the geometry of the output that buffers
+   * its requested region. */
+  OutputImagePointer NewJacobianImage();
+
+  double m_FiniteDifferenceStep;
+
 private:
   ParametricImageSource(const Self&); //purposely not implemented
   void operator=(const Self&); //purposely not implemented
@@ -20,6 +20,8 @@
 #ifndef __itkParametricImageSource_txx
 #define __itkParametricImageSource_txx
 #include "itkParametricImageSource.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
 
 namespace itk
 {
@@ -47,6 +49,8 @@ ParametricImageSource< TOutputImage >
 
   // Set the transform to the identity
   this->m_Transform = TransformType::New();
+
+  this->m_FiniteDifferenceStep = 1e-4;
 }
 
 
@@ -71,6 +75,90 @@ ParametricImageSource< TOutputImage >
 }
 
 
+template< class TOutputImage >
+void
+ParametricImageSource< TOutputImage >
+::GenerateJacobian(const ParametersMaskType& mask, JacobianType& jacobian)
+{
+  jacobian.assign(this->GetNumberOfParameters(), OutputImagePointer());
+  this->GenerateFiniteDifferenceJacobian(mask, jacobian);
+}
+
+
+template< class TOutputImage >
+void
+ParametricImageSource< TOutputImage >
+::GenerateFiniteDifferenceJacobian(const ParametersMaskType& mask,
+                                   JacobianType& jacobian)
+{
+  unsigned int numberOfParameters = this->GetNumberOfParameters();
+  jacobian.resize(numberOfParameters);
+
+  // Defaults the requested region to the largest possible region if
+  // it has not been set.
+  this->GetOutput()->UpdateOutputInformation();
+
+  for (unsigned int i = 0; i < numberOfParameters; i++)
+    {
+    if ( !mask[i] )
+      {
+      continue;
+      }
+
+    ParametersValueType value = this->GetParameter(i);
+    double step = this->m_FiniteDifferenceStep *
+      (value != 0.0 ? fabs(value) : 1.0);
+
+    // The output may buffer more than its requested region, so the
+    // difference is taken over the requested region only.
+    OutputImagePointer derivative = this->NewJacobianImage();
+    RegionType region = derivative->GetBufferedRegion();
+
+    this->SetParameter(i, value + step);
+    this->Update();
+
+    ImageRegionIterator< OutputImageType > dit(derivative, region);
+    ImageRegionConstIterator< OutputImageType > fit(this->GetOutput(), region);
+    for (; !dit.IsAtEnd(); ++dit, ++fit)
+      {
+      dit.Set( fit.Get() );
+      }
+
+    this->SetParameter(i, value - step);
+    this->Update();
+
+    ImageRegionConstIterator< OutputImageType > bit(this->GetOutput(), region);
+    for (dit.GoToBegin(); !dit.IsAtEnd(); ++dit, ++bit)
+      {
+      dit.Set( static_cast<OutputImagePixelType>
+               ((dit.Get() - bit.Get()) / (2.0 * step)) );
+      }
+    jacobian[i] = derivative;
+
+    this->SetParameter(i, value);
+    }
+
+  this->Update();
+}
+
+
+template< class TOutputImage >
+typename ParametricImageSource< TOutputImage >::OutputImagePointer
+ParametricImageSource< TOutputImage >
+::NewJacobianImage()
+{
+  OutputImageType* output = this->GetOutput();
+
+  OutputImagePointer image = OutputImageType::New();
+  image->CopyInformation(output);
+  image->SetBufferedRegion(output->GetRequestedRegion());
+  image->SetRequestedRegion(output->GetRequestedRegion());
+  image->Allocate();
+
+  return image;
+}
+
+
 template< class TOutputImage >
 void
 ParametricImageSource< TOutputImage >
@@ -98,6 +186,8 @@ ParametricImageSource< TOutputImage >
     }
   os << this->m_Size[i] << "]" << std::endl;
 
+  os << indent << "FiniteDifferenceStep: " << this->m_FiniteDifferenceStep
+     << std::endl;
 }
 
 } // end namespace itk
@@ -20,7 +20,11 @@
 #ifndef __itkScanImageFilter_h
 #define __itkScanImageFilter_h
 
-#include "itkImageToImageFilter.h"
+#include "itkInPlaceImageFilter.h"
+#include "itkMultiThreader.h"
+#include "itkProgressReporter.h"
+
+#include <vector>
 
 namespace itk
 {
@@ -36,17 +40,34 @@ namespace itk
  * This class is parameterized over the type of the input and output images.
  *
  * Precision of the accumulation function is determined by the output type.
+ * CompensatedSumAccumulator keeps the scan as accurate as the output
+ * type can store however long the scan is.
+ *
+ * The scan can overwrite its input when the input and output types are
+ * the same, which saves the memory of a second image. In-place
+ * operation is off by default; see InPlaceImageFilter.
+ *
+ * Unless the scan runs along the first dimension, the filter keeps one
+ * accumulator per pixel of a row along the first dimension and
+ * advances the whole row one step along the scan direction at a time.
+ * The inner loop then reads and writes contiguous memory, which
+ * compilers vectorize for simple accumulators, rather than striding
+ * through memory one line at a time.
+ *
+ * When the dimensions other than the scan direction are too short to
+ * give every thread work, a blocked scan can split along the scan
+ * direction instead. See SetUseBlockedScan().
  *
  * \author Cory Quammen. Department of Computer Science, UNC Chapel Hill.
  */
 template <class TInputImage, class TOutputImage, class TAccumulator>
 class ITK_EXPORT ScanImageFilter :
-  public ImageToImageFilter<TInputImage,TOutputImage>
+  public InPlaceImageFilter<TInputImage,TOutputImage>
 {
 public:
   /** Standard class typedefs. */
   typedef ScanImageFilter                               Self;
-  typedef ImageToImageFilter<TInputImage,TOutputImage>  Superclass;
+  typedef InPlaceImageFilter<TInputImage,TOutputImage>  Superclass;
   typedef SmartPointer<Self>                            Pointer;
   typedef SmartPointer<const Self>                      ConstPointer;
 
@@ -54,7 +75,7 @@ public:
   itkNewMacro(Self);
 
   /** Run-time type information (and related methods). */
-  itkTypeMacro(ScanImageFilter, ImageToImageFilter);
+  itkTypeMacro(ScanImageFilter, InPlaceImageFilter);
 
   /** Same convenient typedefs. */
   typedef TInputImage                              InputImageType;
@@ -99,6 +120,18 @@ public:
     this->Modified();
   }
 
+  /** Set/Get whether the scan may be split into blocks along the scan
+   * direction. When the other dimensions cannot be split among all
+   * threads, as for a single line or a radial kernel table only a few
+   * pixels wide, each thread scans one block of slices on its own, the
+   * last slices of the blocks are scanned to find the offset of each
+   * block, and the threads then add the offsets to their blocks. This
+   * is only valid when the value of the accumulator is the sum of its
+   * inputs, as for SumAccumulator. Defaults to false. */
+  itkSetMacro( UseBlockedScan, bool );
+  itkGetConstMacro( UseBlockedScan, bool );
+  itkBooleanMacro( UseBlockedScan );
+
 protected:
   ScanImageFilter();
   virtual ~ScanImageFilter() {};
@@ -113,14 +146,28 @@ protected:
     (const OutputImageRegionType& outputRegion,
      InputImageRegionType& inputRegion);
 
-  /** Split the region into slices orthogonal to the scan direction. */
+  /** Split the region into blocks along the two outermost dimensions
+   * other than the scan direction, so that all threads get work when
+   * either dimension is short. Blocks are never split along the scan
+   * direction. */
   virtual int SplitRequestedRegion(int i, int num, OutputImageRegionType& splitRegion);
 
+  virtual void BeforeThreadedGenerateData();
+
   virtual void ThreadedGenerateData(
     const OutputImageRegionType& outputRegionForThread, int threadId);
 
+  /** Adds the offsets of the blocks of a blocked scan. */
+  virtual void AfterThreadedGenerateData();
+
   virtual AccumulatorType NewAccumulator(unsigned long) const;
 
+  /** Scans the rows along the first dimension of a region together.
+   * Used when the scan direction is not the first dimension. */
+  void ScanRows(const OutputImageRegionType& outputRegionForThread,
+                const InputImageRegionType& inputRegionForThread,
+                ProgressReporter& progress);
+
 private:
   ScanImageFilter(const Self&); // purposely not implemented
   void operator=(const Self&); // purposely not implemented
@@ -129,6 +176,18 @@ private:
 
   unsigned int m_ScanDimension;
 
+  bool         m_UseBlockedScan;
+
+  /** Whether the current update is split along the scan direction,
+   * its blocks, and the values the blocks are offset by, one slice per
+   * block. The first block in scan order has no offset. */
+  bool                                             m_SplitAlongScan;
+  std::vector<OutputImageRegionType>               m_ScanBlocks;
+  std::vector< std::vector<OutputImagePixelType> > m_ScanBlockOffsets;
+
+  /** Adds the offsets to the blocks assigned to a thread. */
+  static ITK_THREAD_RETURN_TYPE AddBlockOffsetsCallback(void* arg);
+
 }; // end class ScanImageFilter
 } // end namespace itk
 
@@ -18,9 +18,15 @@
 #define __itkScanImageFilter_cxx
 
 #include <itkImageLinearConstIteratorWithIndex.h>
+#include <itkImageRegionConstIterator.h>
+#include <itkImageRegionConstIteratorWithIndex.h>
+#include <itkImageRegionIterator.h>
 #include <itkProgressReporter.h>
 #include <itkScanImageFilter.h>
 
+#include <algorithm>
+#include <vector>
+
 namespace itk {
 
 /**
@@ -33,6 +39,11 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
   this->SetNumberOfRequiredInputs(1);
   m_ScanDimension = InputImageDimension-1;
   m_ScanOrder     = INCREASING_ORDER;
+  m_UseBlockedScan = false;
+  m_SplitAlongScan = false;
+
+  // Overwriting the input must be requested.
+  this->InPlaceOff();
 }
 
 
@@ -117,7 +128,6 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
   const typename TOutputImage::SizeType& requestedRegionSize
     = outputPtr->GetRequestedRegion().GetSize();
 
-  int splitAxis;
   typename TOutputImage::IndexType splitIndex;
   typename TOutputImage::SizeType splitSize;
 
@@ -126,43 +136,78 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
   splitIndex  = splitRegion.GetIndex();
   splitSize   = splitRegion.GetSize();
 
-  // Split on the outermost dimension available that is not equal to the
-  // scan dimension.
-  for (unsigned int j = outputPtr->GetImageDimension()-1; j >= 0; j--)
+  // Find the two outermost dimensions that are not the scan dimension
+  // and can be split.
+  int splitAxes[2] = {-1, -1};
+  unsigned int numberOfSplitAxes = 0;
+  for (int j = static_cast<int>(OutputImageDimension)-1;
+       j >= 0 && numberOfSplitAxes < 2; j--)
     {
-    if (j != m_ScanDimension)
+    if (static_cast<unsigned int>(j) != m_ScanDimension &&
+        requestedRegionSize[j] > 1)
       {
-      splitAxis = j;
-      break;
+      splitAxes[numberOfSplitAxes++] = j;
       }
     }
-  while (requestedRegionSize[splitAxis] == 1)
+
+  // Choose the number of pieces along each axis so that their product
+  // uses as many threads as possible, preferring pieces along the
+  // outer axis.
+  long range[2] = {1, 1};
+  long pieces[2] = {1, 1};
+  for (unsigned int k = 0; k < numberOfSplitAxes; k++)
+    {
+    range[k] = static_cast<long>(requestedRegionSize[splitAxes[k]]);
+    }
+  long bestProduct = 1;
+  for (long outer = std::min(static_cast<long>(num), range[0]); outer >= 1; outer--)
     {
-    --splitAxis;
-    if (splitAxis < 0)
-      { // cannot split
-      itkDebugMacro("  Cannot Split");
-      return 1;
+    long inner = std::min(static_cast<long>(num) / outer, range[1]);
+    if (outer * inner > bestProduct)
+      {
+      bestProduct = outer * inner;
+      pieces[0] = outer;
+      pieces[1] = inner;
       }
     }
 
-  // determine the actual number of pieces that will be generated
-  typename TOutputImage::SizeType::SizeValueType range
-    = requestedRegionSize[splitAxis];
-  int valuesPerThread = (int)::vcl_ceil(range/(double)num);
-  int maxThreadIdUsed = (int)::vcl_ceil(range/(double)valuesPerThread) - 1;
+  // Fall back to blocks along the scan dimension if they put more
+  // threads to work.
+  if (m_UseBlockedScan &&
+      bestProduct < std::min(static_cast<long>(num),
+                             static_cast<long>(requestedRegionSize[m_ScanDimension])))
+    {
+    numberOfSplitAxes = 1;
+    splitAxes[0] = m_ScanDimension;
+    range[0] = static_cast<long>(requestedRegionSize[m_ScanDimension]);
+    range[1] = 1;
+    pieces[0] = std::min(static_cast<long>(num), range[0]);
+    pieces[1] = 1;
+    }
+
+  if (numberOfSplitAxes == 0)
+    { // cannot split
+    itkDebugMacro("  Cannot Split");
+    return 1;
+    }
 
-  // Split the region
-  if (i < maxThreadIdUsed)
+  // Determine the actual number of pieces that will be generated along
+  // each axis.
+  long valuesPerPiece[2];
+  for (unsigned int k = 0; k < 2; k++)
     {
-    splitIndex[splitAxis] += i*valuesPerThread;
-    splitSize[splitAxis] = valuesPerThread;
+    valuesPerPiece[k] = (range[k] + pieces[k] - 1) / pieces[k];
+    pieces[k] = (range[k] + valuesPerPiece[k] - 1) / valuesPerPiece[k];
     }
-  if (i == maxThreadIdUsed)
+
+  // Split the region
+  long piece[2] = {i / pieces[1], i % pieces[1]};
+  for (unsigned int k = 0; k < numberOfSplitAxes; k++)
     {
-    splitIndex[splitAxis] += i*valuesPerThread;
-    // last thread needs to process the "rest" dimension being split
-    splitSize[splitAxis] = splitSize[splitAxis] - i*valuesPerThread;
+    int axis = splitAxes[k];
+    splitIndex[axis] += piece[k]*valuesPerPiece[k];
+    splitSize[axis] = std::min(valuesPerPiece[k],
+                               range[k] - piece[k]*valuesPerPiece[k]);
     }
 
   // set the split region ivars
@@ -171,7 +216,37 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
 
   itkDebugMacro("  Split Piece: " << splitRegion );
 
-  return maxThreadIdUsed + 1;
+  return static_cast<int>(pieces[0] * pieces[1]);
+}
+
+
+//----------------------------------------------------------------------------
+template <class TInputImage, class TOutputImage, class TAccumulator>
+void
+ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
+::BeforeThreadedGenerateData()
+{
+  Superclass::BeforeThreadedGenerateData();
+
+  // Record the blocks if the split is along the scan dimension.
+  m_ScanBlocks.clear();
+  m_ScanBlockOffsets.clear();
+
+  OutputImageRegionType splitRegion;
+  int numberOfThreads = this->GetNumberOfThreads();
+  int numberOfSplits = this->SplitRequestedRegion(0, numberOfThreads, splitRegion);
+  m_SplitAlongScan = numberOfSplits > 1 &&
+    splitRegion.GetSize()[m_ScanDimension] <
+    this->GetOutput()->GetRequestedRegion().GetSize()[m_ScanDimension];
+
+  if (m_SplitAlongScan)
+    {
+    for (int i = 0; i < numberOfSplits; i++)
+      {
+      this->SplitRequestedRegion(i, numberOfThreads, splitRegion);
+      m_ScanBlocks.push_back(splitRegion);
+      }
+    }
 }
 
 
@@ -182,18 +257,40 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
 ::ThreadedGenerateData(const OutputImageRegionType& outputRegionForThread,
 		       int threadId)
 {
-  // Use the output image to report the progress. This should be set
-  // to the number of lines.
-  ProgressReporter progress(this, threadId,
-                            outputRegionForThread.GetNumberOfPixels());
-
   // Get some values, just to be easier to manipulate.
   InputImageConstPointer inputImage = this->GetInput();
   OutputImagePointer    outputImage = this->GetOutput();
 
+  // Blocks of a blocked scan start from their own first slice.
   InputImageRegionType inputRegionForThread;
-  this->GenerateInputRequestedRegionForOutputRequestedRegion
-    (outputRegionForThread, inputRegionForThread);
+  if (m_SplitAlongScan)
+    {
+    inputRegionForThread.SetIndex(outputRegionForThread.GetIndex());
+    inputRegionForThread.SetSize(outputRegionForThread.GetSize());
+    }
+  else
+    {
+    this->GenerateInputRequestedRegionForOutputRequestedRegion
+      (outputRegionForThread, inputRegionForThread);
+    }
+
+  // Use the output image to report the progress. This should be set
+  // to the number of lines.
+  unsigned long numberOfLines = outputRegionForThread.GetNumberOfPixels() /
+    std::max(outputRegionForThread.GetSize()[m_ScanDimension],
+             static_cast<typename OutputImageRegionType::SizeValueType>(1));
+
+  if (m_ScanDimension != 0)
+    {
+    // Progress is reported per row of lines.
+    ProgressReporter progress(this, threadId,
+      numberOfLines / std::max(outputRegionForThread.GetSize()[0],
+        static_cast<typename OutputImageRegionType::SizeValueType>(1)));
+    this->ScanRows(outputRegionForThread, inputRegionForThread, progress);
+    return;
+    }
+
+  ProgressReporter progress(this, threadId, numberOfLines);
 
   // Create the iterators for input and output image.
   typedef ImageLinearConstIteratorWithIndex<InputImageType> InputIteratorType;
@@ -254,6 +351,192 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
 }
 
 
+//----------------------------------------------------------------------------
+template <class TInputImage, class TOutputImage, class TAccumulator>
+void
+ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
+::ScanRows(const OutputImageRegionType& outputRegionForThread,
+           const InputImageRegionType& inputRegionForThread,
+           ProgressReporter& progress)
+{
+  InputImageConstPointer inputImage = this->GetInput();
+  OutputImagePointer    outputImage = this->GetOutput();
+
+  const unsigned int scanDimension = m_ScanDimension;
+  const long rowLength   = static_cast<long>(inputRegionForThread.GetSize()[0]);
+  const long scanLength  = static_cast<long>(inputRegionForThread.GetSize()[scanDimension]);
+  const long outputBegin = outputRegionForThread.GetIndex()[scanDimension];
+  const long outputEnd   = outputBegin +
+    static_cast<long>(outputRegionForThread.GetSize()[scanDimension]);
+
+  const long inputStride  = inputImage->GetOffsetTable()[scanDimension];
+  const long outputStride = outputImage->GetOffsetTable()[scanDimension];
+
+  if (rowLength == 0 || scanLength == 0)
+    {
+    return;
+    }
+
+  // One accumulator per pixel of a row.
+  std::vector<AccumulatorType> accumulators(rowLength, this->NewAccumulator(1));
+
+  // Visit the first pixel of each row at the start of the scan.
+  InputImageRegionType rowStartRegion = inputRegionForThread;
+  typename InputImageRegionType::SizeType rowStartSize = rowStartRegion.GetSize();
+  rowStartSize[0] = 1;
+  rowStartSize[scanDimension] = 1;
+  rowStartRegion.SetSize(rowStartSize);
+
+  ImageRegionConstIteratorWithIndex<InputImageType> rowIt(inputImage, rowStartRegion);
+  for (; !rowIt.IsAtEnd(); ++rowIt)
+    {
+    for (long x = 0; x < rowLength; x++)
+      {
+      accumulators[x].Initialize();
+      }
+
+    typename InputImageType::IndexType index = rowIt.GetIndex();
+    long step = 1;
+    if (m_ScanOrder == DECREASING_ORDER)
+      {
+      index[scanDimension] += scanLength - 1;
+      step = -1;
+      }
+
+    const InputImagePixelType* in = inputImage->GetBufferPointer() +
+      inputImage->ComputeOffset(index);
+    OutputImagePixelType* out = outputImage->GetBufferPointer() +
+      outputImage->ComputeOffset(index);
+    AccumulatorType* acc = &accumulators[0];
+
+    for (long k = 0; k < scanLength; k++, in += step*inputStride,
+           out += step*outputStride, index[scanDimension] += step)
+      {
+      // Slices before the output region only feed the accumulators.
+      if (index[scanDimension] < outputBegin || index[scanDimension] >= outputEnd)
+        {
+        for (long x = 0; x < rowLength; x++)
+          {
+          acc[x]( in[x] );
+          }
+        continue;
+        }
+
+      for (long x = 0; x < rowLength; x++)
+        {
+        acc[x]( in[x] );
+        out[x] = acc[x].GetValue();
+        }
+      }
+
+    // Report that the row is finished.
+    progress.CompletedPixel();
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template <class TInputImage, class TOutputImage, class TAccumulator>
+void
+ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
+::AfterThreadedGenerateData()
+{
+  if (!m_SplitAlongScan)
+    {
+    return;
+    }
+
+  OutputImagePointer outputImage = this->GetOutput();
+  const unsigned int numberOfBlocks = m_ScanBlocks.size();
+
+  // Visit the blocks in scan order.
+  std::vector<unsigned int> order(numberOfBlocks);
+  for (unsigned int b = 0; b < numberOfBlocks; b++)
+    {
+    order[b] = m_ScanOrder == INCREASING_ORDER ? b : numberOfBlocks - 1 - b;
+    }
+
+  // The offset of a block is the offset of the block before it plus
+  // the last slice of that block, which is scanned serially.
+  m_ScanBlockOffsets.assign(numberOfBlocks, std::vector<OutputImagePixelType>());
+  for (unsigned int b = 1; b < numberOfBlocks; b++)
+    {
+    unsigned int previous = order[b-1];
+    OutputImageRegionType lastSlice = m_ScanBlocks[previous];
+    typename OutputImageRegionType::IndexType index = lastSlice.GetIndex();
+    typename OutputImageRegionType::SizeType  size  = lastSlice.GetSize();
+    if (m_ScanOrder == INCREASING_ORDER)
+      {
+      index[m_ScanDimension] += size[m_ScanDimension] - 1;
+      }
+    size[m_ScanDimension] = 1;
+    lastSlice.SetIndex(index);
+    lastSlice.SetSize(size);
+
+    const std::vector<OutputImagePixelType>& previousOffset =
+      m_ScanBlockOffsets[previous];
+    std::vector<OutputImagePixelType>& offset = m_ScanBlockOffsets[order[b]];
+    offset.reserve(lastSlice.GetNumberOfPixels());
+
+    ImageRegionConstIterator<OutputImageType> it(outputImage, lastSlice);
+    for (unsigned long p = 0; !it.IsAtEnd(); ++it, ++p)
+      {
+      offset.push_back(previousOffset.empty() ?
+                       it.Get() : static_cast<OutputImagePixelType>(previousOffset[p] + it.Get()));
+      }
+    }
+
+  // Add the offsets to the blocks in parallel.
+  this->GetMultiThreader()->SetNumberOfThreads(numberOfBlocks);
+  this->GetMultiThreader()->SetSingleMethod(this->AddBlockOffsetsCallback, this);
+  this->GetMultiThreader()->SingleMethodExecute();
+}
+
+
+//----------------------------------------------------------------------------
+template <class TInputImage, class TOutputImage, class TAccumulator>
+ITK_THREAD_RETURN_TYPE
+ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
+::AddBlockOffsetsCallback(void* arg)
+{
+  MultiThreader::ThreadInfoStruct* info =
+    static_cast<MultiThreader::ThreadInfoStruct*>(arg);
+  Self* filter = static_cast<Self*>(info->UserData);
+  OutputImagePointer outputImage = filter->GetOutput();
+
+  for (unsigned int b = info->ThreadID; b < filter->m_ScanBlocks.size();
+       b += info->NumberOfThreads)
+    {
+    const std::vector<OutputImagePixelType>& offset = filter->m_ScanBlockOffsets[b];
+    if (offset.empty())
+      {
+      continue;
+      }
+
+    // Add the offset slice to each slice of the block.
+    const OutputImageRegionType& block = filter->m_ScanBlocks[b];
+    OutputImageRegionType slice = block;
+    typename OutputImageRegionType::SizeType size = slice.GetSize();
+    size[filter->m_ScanDimension] = 1;
+    slice.SetSize(size);
+    for (unsigned long k = 0; k < block.GetSize()[filter->m_ScanDimension]; k++)
+      {
+      typename OutputImageRegionType::IndexType index = block.GetIndex();
+      index[filter->m_ScanDimension] += k;
+      slice.SetIndex(index);
+
+      ImageRegionIterator<OutputImageType> it(outputImage, slice);
+      for (unsigned long p = 0; !it.IsAtEnd(); ++it, ++p)
+        {
+        it.Set( static_cast<OutputImagePixelType>(it.Get() + offset[p]) );
+        }
+      }
+    }
+
+  return ITK_THREAD_RETURN_VALUE;
+}
+
+
 //----------------------------------------------------------------------------
 template <class TInputImage, class TOutputImage, class TAccumulator>
 TAccumulator
@@ -276,6 +559,7 @@ ScanImageFilter<TInputImage,TOutputImage,TAccumulator>
   const char *scanOrderString = (m_ScanOrder == INCREASING_ORDER) ?
     "INCREASING_ORDER" : "DECREASING_ORDER";
   os << indent << "ScanOrder: " << scanOrderString << std::endl;
+  os << indent << "UseBlockedScan: " << m_UseBlockedScan << std::endl;
 }
 
 
@@ -20,26 +20,18 @@
 #ifndef __itkSphereConvolutionFilter_h
 #define __itkSphereConvolutionFilter_h
 
+#include "itkCompensatedSumAccumulator.h"
+#include "itkFFTComplexConjugateToRealImageFilter.h"
+#include "itkFFTRealToComplexConjugateImageFilter.h"
 #include "itkImageToImageFilter.h"
-#include "itkLinearInterpolateImageFunction.h"
 #include "itkScanImageFilter.h"
-#include "itkSumProjectionImageFilter.h"
+#include "itkWorkStealingRegionScheduler.h"
 
-#include <list>
+#include <vector>
 
 namespace itk
 {
 
-/** Struct to hold sphere intersection data. */
-typedef struct SphereIntersection_struct {
-  double x;
-  double y;
-  double z1;
-  double z2;
-  int numIntersections;
-} SphereIntersection;
-
-
 /** \class SphereConvolutionFilter
  *
  * \brief Generate an image of a sphere convolved with the input image.
@@ -56,6 +48,21 @@ typedef struct SphereIntersection_struct {
  * accuracy, the input kernel image should be more finely sampled than
  * the output image.
  *
+ * The lookups are trilinear interpolations done directly on the buffer
+ * of the scanned kernel, which is assumed to have an identity direction
+ * matrix.
+ *
+ * Only the requested region of the output is computed. With the chord
+ * method, the input requested region is narrowed to the kernel columns
+ * that the lookups for the output requested region can reach, over
+ * the full extent of the kernel in z. Adaptive integration also needs
+ * the columns within the sphere radius of the sphere center.
+ *
+ * Alternatively, the filter can convolve the kernel with a
+ * partial-volume image of the sphere in the Fourier domain and
+ * interpolate the output from the result. See
+ * SetConvolutionMethodToFFT().
+ *
  * \author Cory Quammen. Department of Computer Science, UNC Chapel Hill.
  *
  * \ingroup Multithreaded
@@ -94,21 +101,30 @@ public:
   typedef InputImageSizeType                        SizeType;
   typedef typename SizeType::SizeValueType          SizeValueType;
 
-  typedef Function::SumAccumulator<InputImagePixelType,OutputImagePixelType>
+  /** The scan is summed with compensation so that a float kernel
+   * table is as accurate as its pixel type allows. */
+  typedef Function::CompensatedSumAccumulator<InputImagePixelType,InputImagePixelType>
     AccumulatorType;
   typedef ScanImageFilter<InputImageType, InputImageType, AccumulatorType>
     ScanImageFilterType;
   typedef typename ScanImageFilterType::Pointer
     ScanImageFilterPointer;
-  typedef LinearInterpolateImageFunction<InputImageType, float>
-    InterpolatorType;
-  typedef typename InterpolatorType::Pointer
-    InterpolatorPointer;
 
-  typedef std::list<SphereIntersection>
-    IntersectionArrayType;
-  typedef typename IntersectionArrayType::const_iterator
-    IntersectionArrayConstIterator;
+  typedef std::vector<double>                       IntersectionArrayType;
+
+  typedef FFTRealToComplexConjugateImageFilter<InputImagePixelType,
+                                               TInputImage::ImageDimension>
+    ForwardFFTType;
+  typedef FFTComplexConjugateToRealImageFilter<InputImagePixelType,
+                                               TInputImage::ImageDimension>
+    InverseFFTType;
+  typedef typename ForwardFFTType::TOutputImageType
+    ComplexImageType;
+
+  typedef WorkStealingRegionScheduler<OutputImageRegionType>
+    SchedulerType;
+  typedef typename SchedulerType::Pointer
+    SchedulerPointer;
 
   itkStaticConstMacro(ImageDimension, unsigned int,
 		      TOutputImage::ImageDimension);
@@ -212,6 +228,163 @@ public:
   itkGetMacro(WeightIntegrationByArea, bool);
   itkBooleanMacro(WeightIntegrationByArea);
 
+  /** Set/get an affine map applied to the output intensities as they
+   * are written, so that the output is OutputShift plus OutputScale
+   * times the integrated convolution. Applying it here saves a
+   * separate pass over the output and a second output image. Default
+   * to a shift of zero and a scale of one. */
+  itkSetMacro(OutputShift, double);
+  itkGetConstMacro(OutputShift, double);
+  itkSetMacro(OutputScale, double);
+  itkGetConstMacro(OutputScale, double);
+
+  /** Set/get the relative tolerance of adaptive voxel integration.
+   * When positive, each voxel starts from the sample at its center
+   * and is split into octants, recursively, wherever the mean of the
+   * eight octant samples differs from the coarser estimate by more
+   * than the tolerance times the convolution at the sphere center.
+   * Samples are then spent where the convolution varies quickly, as
+   * in the rings near focus, and not where it is smooth. The result
+   * is scaled as the sum of NumberOfIntegrationSamples samples would
+   * be. Adaptive integration evaluates the chords at every sample, so
+   * it does not use radial profiles or the summed-volume table. When
+   * zero, the voxels are sampled uniformly. Defaults to zero. */
+  itkSetMacro(IntegrationRelativeTolerance, double);
+  itkGetConstMacro(IntegrationRelativeTolerance, double);
+
+  /** Set/get the maximum number of times adaptive integration splits
+   * a voxel, so that at most 2^depth samples are taken along each
+   * dimension. Defaults to 4. */
+  itkSetMacro(MaximumIntegrationDepth, unsigned int);
+  itkGetConstMacro(MaximumIntegrationDepth, unsigned int);
+
+  /** Get the number of points at which the convolution was evaluated
+   * or interpolated during the last update. Each voxel integrated
+   * with the summed-volume table counts once. */
+  itkGetConstMacro(NumberOfSampleEvaluations, unsigned long);
+
+  /** Determines whether the chord method integrates each output voxel
+   * exactly over its box using a summed-volume table instead of
+   * summing the number of integration samples. The table holds the
+   * integral of the scanned kernel along x, y and z, so the box
+   * integral of each chord takes a fixed number of lookups however
+   * finely the voxel would otherwise be sampled. The result is the
+   * limit of the sample sum as the number of samples grows, scaled as
+   * the sample sum is. The table is interpolated linearly between its
+   * nodes, so for voxels about the size of the kernel spacing the
+   * result is about as accurate as three or four samples per
+   * dimension, and more accurate for larger voxels. Radial kernels are
+   * expanded to 3D for the table. Defaults to false. */
+  itkSetMacro(UseSummedVolumeTable, bool);
+  itkGetConstMacro(UseSummedVolumeTable, bool);
+  itkBooleanMacro(UseSummedVolumeTable);
+
+  /** Methods for computing the convolution. */
+  typedef enum {
+    CHORD_CONVOLUTION,
+    FFT_CONVOLUTION
+  } ConvolutionMethod;
+
+  /** Set/get the method used to compute the convolution. The chord
+   * method sums lookups in the scanned kernel over a grid of vertical
+   * lines through the sphere for every output sample. The FFT method
+   * samples the sphere as a partial-volume image on the grid of the
+   * kernel, convolves the two in the Fourier domain, and interpolates
+   * the output samples from the result. Its cost does not depend on
+   * the number of output samples, and the convolved table is reused
+   * while the kernel and the sphere radius stay the same, but the
+   * sphere surface is only resolved to the kernel spacing. Defaults
+   * to the chord method. */
+  void SetConvolutionMethodToChords()
+  {
+    if (m_ConvolutionMethod != CHORD_CONVOLUTION)
+      {
+      m_ConvolutionMethod = CHORD_CONVOLUTION;
+      this->Modified();
+      }
+  }
+
+  void SetConvolutionMethodToFFT()
+  {
+    if (m_ConvolutionMethod != FFT_CONVOLUTION)
+      {
+      m_ConvolutionMethod = FFT_CONVOLUTION;
+      this->Modified();
+      }
+  }
+
+  itkGetConstMacro(ConvolutionMethod, ConvolutionMethod);
+
+  /** Set/get the number of samples per dimension used to compute the
+   * fraction of a kernel voxel covered by the sphere in the FFT
+   * method. Only voxels cut by the sphere surface are subsampled.
+   * Defaults to 8. */
+  itkSetMacro(SphereSubsamples, unsigned int);
+  itkGetConstMacro(SphereSubsamples, unsigned int);
+
+  /** Set/get the radial spacing of the profiles used for radially
+   * symmetric kernels. With a radial kernel, the convolution is
+   * radially symmetric about the z-axis through the sphere center, so
+   * the chord method computes it once per sample z-coordinate on a
+   * radial grid with this spacing and interpolates the output samples
+   * from these profiles. The profiles are extended only as far as the
+   * output samples need. The default of 5 nm is half the spacing of
+   * the chords, below which the interpolation error is negligible. A
+   * spacing of zero evaluates the chords at every output sample. */
+  itkSetMacro(RadialProfileSpacing, double);
+  itkGetConstMacro(RadialProfileSpacing, double);
+
+  /** Get the scheduler that distributes tiles of the output among
+   * the threads. Set its tile size to change the granularity of the
+   * load balancing, and query it for the per-thread statistics of the
+   * last update. */
+  itkGetObjectMacro(Scheduler, SchedulerType);
+
+  /** Set a precomputed scan of the input kernel along z. When set,
+   * the filter uses it as the lookup table instead of scanning the
+   * input, so it must be the scan of the current input. Set it to
+   * NULL to scan the input again. */
+  void SetScannedKernel(InputImageType* scannedKernel)
+  {
+    if (scannedKernel != m_ScannedKernel)
+      {
+      m_ScannedKernel = scannedKernel;
+      this->Modified();
+      }
+  }
+
+  /** Set/get whether the kernel is scanned in place, which saves the
+   * memory of a second kernel-sized table. The input kernel is then
+   * overwritten by its scan and its upstream pipeline re-executes
+   * whenever the kernel is scanned again. The FFT method reads the
+   * kernel itself, so it must not follow an in-place scan of the same
+   * kernel. Defaults to false. */
+  void SetScanKernelInPlace(bool inPlace)
+  {
+    if (inPlace != m_ScanImageFilter->GetInPlace())
+      {
+      m_ScanImageFilter->SetInPlace(inPlace);
+      this->Modified();
+      }
+  }
+
+  bool GetScanKernelInPlace() const
+  {
+    return m_ScanImageFilter->GetInPlace();
+  }
+
+  itkBooleanMacro(ScanKernelInPlace);
+
+  /** Get the scan of the input kernel used in the last update. */
+  InputImageType* GetScannedKernel()
+  {
+    if (m_ScannedKernel)
+      {
+      return m_ScannedKernel;
+      }
+    return m_ScanImageFilter->GetOutput();
+  }
+
 protected:
   SphereConvolutionFilter();
   ~SphereConvolutionFilter();
@@ -232,6 +405,19 @@ protected:
     calculation, otherise use volume weighting. */
   bool                   m_WeightIntegrationByArea;
 
+  /** Affine map of the output intensities. */
+  double                 m_OutputShift;
+  double                 m_OutputScale;
+
+  /** Adaptive integration settings, and the convolution at the sphere
+   * center that the tolerance is relative to. */
+  double                 m_IntegrationRelativeTolerance;
+  unsigned int           m_MaximumIntegrationDepth;
+  double                 m_IntegrationScale;
+
+  std::vector<unsigned long> m_SampleEvaluationsPerThread;
+  unsigned long              m_NumberOfSampleEvaluations;
+
   /** Shear in the x direction w.r.t. z. */
   double                 m_ShearX;
 
@@ -249,14 +435,85 @@ protected:
   SizeType               m_NumberOfIntegrationSamples;
 
   ScanImageFilterPointer m_ScanImageFilter;
-  InterpolatorPointer    m_TableInterpolator;
+
+  /** Distributes output tiles among the threads. */
+  SchedulerPointer       m_Scheduler;
+
+  /** Precomputed scan of the input kernel, if any. */
+  InputImagePointer      m_ScannedKernel;
 
   /* Vertical line sample spacing in X and Y. */
   double m_LineSampleSpacing;
 
+  /** Method used to compute the convolution. */
+  ConvolutionMethod      m_ConvolutionMethod;
+
+  /** Subsamples per dimension of the partial-volume sphere image. */
+  unsigned int           m_SphereSubsamples;
+
+  /** Convolution of the kernel with the sphere computed by the FFT
+   * method, along with the kernel and sphere radius it was computed
+   * for. The table is indexed by offset from the sphere center. */
+  InputImagePointer      m_ConvolutionTable;
+  const InputImageType*  m_ConvolutionTableKernel;
+  unsigned long          m_ConvolutionTableKernelMTime;
+  double                 m_ConvolutionTableRadius;
+  unsigned int           m_ConvolutionTableSubsamples;
+
+  /** Summed-volume table of the scanned kernel, in units of table
+   * voxels, on the grid of m_SummedVolumeTableGrid, and the integral
+   * over x and y of the top plane of the scan, which extends the table
+   * above its top. Also the scanned kernel they were computed for. */
+  bool                   m_UseSummedVolumeTable;
+  std::vector<double>    m_SummedVolumeTable;
+  std::vector<double>    m_SummedTopPlane;
+  InputImagePointer      m_SummedVolumeTableGrid;
+  const InputImageType*  m_SummedVolumeTableKernel;
+  unsigned long          m_SummedVolumeTableKernelMTime;
+
+  /** Radial spacing of the profiles for radially symmetric kernels. */
+  double                 m_RadialProfileSpacing;
+
+  /** Radial profiles of the convolution at the sample z-coordinates
+   * of one output slice, kept by each thread. */
+  struct RadialProfileCache
+  {
+    std::vector<double>                z;
+    std::vector< std::vector<double> > profiles;
+  };
+
+  /** Sample coordinates of the voxels of one output tile and their
+   * chord sums, kept by each thread across tiles. */
+  struct ChordTileBuffer
+  {
+    std::vector<double> x;
+    std::vector<double> y;
+    std::vector<double> z;
+    std::vector<double> sums;
+  };
+
   /** Contains intersection data of a grid of sample points in the
-   * xy-plane. */
-  IntersectionArrayType m_IntersectionArray;
+   * xy-plane. The coordinates are kept in separate contiguous arrays
+   * so that ComputeSampleValue() can stream through them. Only lines
+   * that cross the sphere twice are stored. */
+  IntersectionArrayType m_IntersectionX;
+  IntersectionArrayType m_IntersectionY;
+  IntersectionArrayType m_IntersectionZ1;
+  IntersectionArrayType m_IntersectionZ2;
+
+  /** Geometry of the scanned kernel table, cached in
+   * BeforeThreadedGenerateData(). The origin is that of the first
+   * buffered voxel. Steps and strides are in pixels; the step to the
+   * upper interpolation corner is zero along dimensions of size one. */
+  const InputImagePixelType* m_TableBuffer;
+  double                 m_TableOrigin[3];
+  double                 m_TableInverseSpacing[3];
+  double                 m_TableMaximumIndex[3];
+  long                   m_TableLastCell[3];
+  long                   m_TableStride[3];
+  long                   m_TableStep[3];
+  double                 m_TableSpacingZ;
+  bool                   m_RadialTable;
 
   /** Gets the z-coordinate(s) of the intersection of a sphere with a line
    * parallel to the z-axis specified by the x- and y-coordinates. z1 and z2
@@ -274,21 +531,97 @@ protected:
   void ComputeIntersections();
 
   /** Helper method for ComputeIntersections() method. Adds an
-   * intersection to the m_IntersectionArray if an intersection
-   * occurs. */
+   * intersection to the intersection arrays if the vertical line
+   * through (xs, ys) crosses the sphere twice. */
   void AddIntersection(double xs, double ys);
 
+  /** Caches the geometry of the lookup table for InterpolateTable(). */
+  void SetLookupTable(const InputImageType* table);
+
+  /** Trilinear interpolation of a table with the geometry of the
+   * lookup table at a continuous index that lies within the table. */
+  template <class TValue>
+  inline double InterpolateTable(const TValue* table,
+                                 double cx, double cy, double cz) const;
+
+  /** Computes the summed-volume table of the scanned kernel. */
+  void ComputeSummedVolumeTable();
+
+  /** Replaces the samples of a line with their cumulative integral
+   * under the trapezoidal rule, starting from zero. */
+  static void IntegrateLine(double* line, long length, long stride);
+
+  /** Evaluates the summed-volume table at a continuous index, which
+   * may lie outside the table. */
+  inline double EvaluateSummedVolume(double cx, double cy, double cz) const;
+
+  /** Computes the integral of the convolution over the box with the
+   * given center and size from the summed-volume table. */
+  double ComputeBoxIntegral(const OutputImagePointType& center,
+                            const OutputImageSpacingType& size);
+
+  /** Computes m_ConvolutionTable for the FFT method. */
+  void ComputeConvolutionTable();
+
+  /** Returns the kernel, or its scan, resampled on a full 3D grid with
+   * equal x and y spacing, expanding it around the z-axis if it is
+   * radial. */
+  InputImagePointer ExpandKernel(const InputImageType* kernel) const;
+
+  /** Returns the fraction of the box with the given center and half
+   * widths, relative to the sphere center, covered by the sphere. */
+  double ComputeSphereFraction(const double center[3],
+                               const double halfWidth[3]) const;
+
   virtual void BeforeThreadedGenerateData();
 
   virtual void ThreadedGenerateData
     (const OutputImageRegionType& outputRegionForThread, int threadId);
 
+  virtual void AfterThreadedGenerateData();
+
   /** Computes the light intensity at a specified point. */
   double ComputeSampleValue(OutputImagePointType& point);
 
+  /** Adds the chord sums at n sample points, relative to the sphere
+   * center, to sums. Chords are iterated in the outer loop, so the
+   * table cells a chord reads for nearby points are still cached when
+   * the next point reads them. */
+  void AccumulateChordSums(const double* x, const double* y,
+                           const double* z, size_t n, double* sums) const;
+
+  /** Computes the integrated light intensity of the voxels of a tile
+   * with the chord method. The samples of all voxels in the tile are
+   * gathered first and the chords swept over them together. */
+  void ComputeTileByChords(const OutputImageRegionType& tile,
+                           const SpacingType& dx, double volume,
+                           ChordTileBuffer& buffer);
+
+  /** Computes the light intensity at a specified point from the
+   * FFT-convolved table. */
+  double ComputeFFTSampleValue(OutputImagePointType& point);
+
   /** Computes the integrated light intensity over multipe samples per voxel.*/
   double ComputeIntegratedVoxelValue(OutputImagePointType& point, const SpacingType& dx);
 
+  /** Computes the mean light intensity over a voxel by adaptive
+   * subdivision, given the intensity at its center. */
+  double ComputeAdaptiveVoxelValue(const OutputImagePointType& center,
+                                   const SpacingType& halfWidth,
+                                   double centerValue, double tolerance,
+                                   unsigned int depth,
+                                   unsigned long& evaluations);
+
+  /** Computes the integrated light intensity over multiple samples per
+   * voxel from radial profiles for radially symmetric kernels. */
+  double ComputeIntegratedVoxelValueFromProfiles(OutputImagePointType& point,
+                                                 const SpacingType& dx,
+                                                 RadialProfileCache& cache);
+
+  /** Interpolates a radial profile at sample z-coordinate z, extending
+   * the profile as needed. */
+  double EvaluateRadialProfile(std::vector<double>& profile, double z, double rho);
+
 private:
   SphereConvolutionFilter(const SphereConvolutionFilter&); // purposely not implemented
   void operator=(const SphereConvolutionFilter&); //purposely not implemented
@@ -21,7 +21,12 @@
 #define __itkSphereConvolutionFilter_cxx
 
 #include "itkSphereConvolutionFilter.h"
+#include "itkImageRegionConstIterator.h"
+#include "itkImageRegionIterator.h"
 #include "itkImageRegionIteratorWithIndex.h"
+#include "itkMath.h"
+
+#include <algorithm>
 
 namespace itk {
 
@@ -41,14 +46,47 @@ SphereConvolutionFilter<TInputImage,TOutputImage>
   this->m_UseCustomZCoordinates = false;
   this->m_NumberOfIntegrationSamples.Fill(1);
   this->m_WeightIntegrationByArea = false;
+  this->m_OutputShift = 0.0;
+  this->m_OutputScale = 1.0;
+  this->m_IntegrationRelativeTolerance = 0.0;
+  this->m_MaximumIntegrationDepth = 4;
+  this->m_IntegrationScale = 0.0;
+  this->m_NumberOfSampleEvaluations = 0;
 
   m_ScanImageFilter = ScanImageFilterType::New();
   m_ScanImageFilter->SetScanDimension(2);
   m_ScanImageFilter->SetScanOrderToIncreasing();
+  m_ScanImageFilter->UseBlockedScanOn();
+
+  m_Scheduler = SchedulerType::New();
 
-  m_TableInterpolator = InterpolatorType::New();
+  m_TableBuffer = NULL;
+  m_TableSpacingZ = 1.0;
+  m_RadialTable = false;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    m_TableOrigin[i] = 0.0;
+    m_TableInverseSpacing[i] = 1.0;
+    m_TableMaximumIndex[i] = 0.0;
+    m_TableLastCell[i] = 0;
+    m_TableStride[i] = 0;
+    m_TableStep[i] = 0;
+    }
 
   m_LineSampleSpacing = 10; // 10 nm line spacing
+
+  m_ConvolutionMethod = CHORD_CONVOLUTION;
+  m_SphereSubsamples = 8;
+  m_ConvolutionTableKernel = NULL;
+  m_ConvolutionTableKernelMTime = 0;
+  m_ConvolutionTableRadius = 0.0;
+  m_ConvolutionTableSubsamples = 0;
+
+  m_RadialProfileSpacing = 5.0; // 5 nm profile spacing
+
+  m_UseSummedVolumeTable = false;
+  m_SummedVolumeTableKernel = NULL;
+  m_SummedVolumeTableKernelMTime = 0;
 }
 
 
@@ -128,13 +166,111 @@ SphereConvolutionFilter<TInputImage,TOutputImage>
 {
   Superclass::GenerateInputRequestedRegion();
 
-  if (this->GetInput(0))
+  if (!this->GetInput(0))
+    {
+    return;
+    }
+
+  InputImagePointer input = const_cast< TInputImage * > ( this->GetInput(0) );
+  InputImageRegionType inputRegion = input->GetLargestPossibleRegion();
+
+  // The FFT method and the summed-volume table read the whole kernel.
+  // The chord lookups read whole columns of the scan, which runs from
+  // the bottom of the table along z, so only x and y are restricted.
+  bool useTable = m_UseSummedVolumeTable && m_IntegrationRelativeTolerance <= 0.0;
+  OutputImageRegionType outputRegion = this->GetOutput()->GetRequestedRegion();
+  if (m_ConvolutionMethod != CHORD_CONVOLUTION || useTable ||
+      m_SphereRadius < 0.0 || outputRegion.GetNumberOfPixels() == 0)
     {
-    InputImagePointer input = const_cast< TInputImage * > ( this->GetInput(0) );
-    InputImageRegionType inputRegion;
-    inputRegion = input->GetLargestPossibleRegion();
     input->SetRequestedRegion( inputRegion );
+    return;
+    }
+
+  // Extent of the sample points in the requested region, which lie
+  // within half a voxel of the voxel centers.
+  OutputImagePointType first;
+  OutputImagePointType last;
+  for ( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    first[i] = m_Origin[i] + m_Spacing[i] *
+      (static_cast<double>(outputRegion.GetIndex()[i]) - 0.5);
+    last[i]  = m_Origin[i] + m_Spacing[i] *
+      (static_cast<double>(outputRegion.GetIndex()[i] +
+                           static_cast<long>(outputRegion.GetSize()[i])) - 0.5);
+    }
+  if (m_UseCustomZCoordinates)
+    {
+    first[2] = NumericTraits<double>::max();
+    last[2]  = NumericTraits<double>::NonpositiveMin();
+    for ( SizeValueType k = 0; k < outputRegion.GetSize()[2]; k++ )
+      {
+      double z = this->GetZCoordinate(outputRegion.GetIndex()[2] + k);
+      first[2] = std::min(first[2], z - 0.5*m_Spacing[2]);
+      last[2]  = std::max(last[2],  z + 0.5*m_Spacing[2]);
+      }
+    }
+
+  // Extent of the lookups relative to the sphere center, including the
+  // shear and the chord offsets.
+  double lower[2];
+  double upper[2];
+  double shear[2] = {m_ShearX, m_ShearY};
+  for ( unsigned int i = 0; i < 2; i++ )
+    {
+    double shift1 = shear[i] * (first[2] - m_SphereCenter[2]);
+    double shift2 = shear[i] * (last[2]  - m_SphereCenter[2]);
+    lower[i] = first[i] - std::max(shift1, shift2) - m_SphereCenter[i] - m_SphereRadius;
+    upper[i] = last[i]  - std::min(shift1, shift2) - m_SphereCenter[i] + m_SphereRadius;
+    }
+
+  // Adaptive integration scales its tolerance by the convolution at
+  // the sphere center, whose lookups reach the sphere radius around it.
+  if (m_IntegrationRelativeTolerance > 0.0)
+    {
+    for ( unsigned int i = 0; i < 2; i++ )
+      {
+      lower[i] = std::min(lower[i], -m_SphereRadius);
+      upper[i] = std::max(upper[i],  m_SphereRadius);
+      }
+    }
+
+  // A radial table is looked up by the distance from the axis, up to
+  // one radial profile point beyond the farthest sample.
+  unsigned int columnDimensions = 2;
+  if (inputRegion.GetSize()[1] == 1)
+    {
+    double x = std::max(fabs(lower[0]), fabs(upper[0]));
+    double y = std::max(fabs(lower[1]), fabs(upper[1]));
+    lower[0] = input->GetOrigin()[0];
+    upper[0] = sqrt(x*x + y*y) + m_RadialProfileSpacing;
+    columnDimensions = 1;
+    }
+
+  // Pad by one cell for the interpolation and keep within the table.
+  InputImageIndexType index = inputRegion.GetIndex();
+  InputImageSizeType  size  = inputRegion.GetSize();
+  for ( unsigned int i = 0; i < columnDimensions; i++ )
+    {
+    double origin  = input->GetOrigin()[i];
+    double spacing = input->GetSpacing()[i];
+    long firstIndex = Math::Floor<long>((lower[i] - origin) / spacing) - 1;
+    long lastIndex  = Math::Ceil<long>((upper[i] - origin) / spacing) + 1;
+    long tableFirst = inputRegion.GetIndex()[i];
+    long tableLast  = tableFirst + static_cast<long>(inputRegion.GetSize()[i]) - 1;
+    firstIndex = std::max(firstIndex, tableFirst);
+    lastIndex  = std::min(lastIndex, tableLast);
+    if (lastIndex < firstIndex)
+      {
+      // No lookup falls in the table, but keep a valid request.
+      lastIndex = firstIndex;
+      }
+    index[i] = firstIndex;
+    size[i]  = static_cast<SizeValueType>(lastIndex - firstIndex + 1);
     }
+
+  inputRegion.SetIndex(index);
+  inputRegion.SetSize(size);
+  input->SetRequestedRegion( inputRegion );
 }
 
 
@@ -164,8 +300,11 @@ void
 SphereConvolutionFilter<TInputImage,TOutputImage>
 ::ComputeIntersections()
 {
-  // Clear the intersection list
-  m_IntersectionArray.clear();
+  // Clear the intersection arrays
+  m_IntersectionX.clear();
+  m_IntersectionY.clear();
+  m_IntersectionZ1.clear();
+  m_IntersectionZ2.clear();
 
   // Add intersection at origin point
   AddIntersection(0.0, 0.0);
@@ -195,15 +334,14 @@ SphereConvolutionFilter<TInputImage,TOutputImage>
   unsigned int numIntersections;
   numIntersections = IntersectWithVerticalLine(xs, ys, z1, z2);
 
-  if ( numIntersections > 0 )
+  // Lines tangent to the sphere contribute nothing to the
+  // convolution, so only keep lines that pass through it.
+  if ( numIntersections == 2 )
     {
-    SphereIntersection intersection;
-    intersection.x = xs;
-    intersection.y = ys;
-    intersection.z1 = z1;
-    intersection.z2 = z2;
-    intersection.numIntersections = numIntersections;
-    m_IntersectionArray.push_back(intersection);
+    m_IntersectionX.push_back(xs);
+    m_IntersectionY.push_back(ys);
+    m_IntersectionZ1.push_back(z1);
+    m_IntersectionZ2.push_back(z2);
     }
 }
 
@@ -213,16 +351,528 @@ void
 SphereConvolutionFilter<TInputImage,TOutputImage>
 ::BeforeThreadedGenerateData()
 {
-  // Compute the scan of the convolution kernel.
-  m_ScanImageFilter->SetInput(this->GetInput());
-  m_ScanImageFilter->UpdateLargestPossibleRegion();
+  // Queue the tiles of each thread's part of the output. Threads that
+  // run out of tiles steal them from the others.
+  OutputImageRegionType splitRegion;
+  int numberOfThreads = this->GetNumberOfThreads();
+  int numberOfSplits = this->SplitRequestedRegion(0, numberOfThreads, splitRegion);
+  m_Scheduler->Initialize(numberOfSplits);
+  for ( int i = 0; i < numberOfSplits; i++ )
+    {
+    this->SplitRequestedRegion(i, numberOfThreads, splitRegion);
+    m_Scheduler->AddRegion(i, splitRegion);
+    }
+  m_SampleEvaluationsPerThread.assign(numberOfThreads, 0);
+
+  if (m_ConvolutionMethod == FFT_CONVOLUTION)
+    {
+    this->ComputeConvolutionTable();
+    this->SetLookupTable(m_ConvolutionTable);
+    m_RadialTable = false;
+    }
+  else
+    {
+    // Compute the scan of the convolution kernel unless a precomputed
+    // scan was provided.
+    if (!m_ScannedKernel)
+      {
+      m_ScanImageFilter->SetInput(this->GetInput());
+      m_ScanImageFilter->GetOutput()->
+        SetRequestedRegion(this->GetInput()->GetRequestedRegion());
+      m_ScanImageFilter->Update();
+      }
+
+    if (m_UseSummedVolumeTable && m_IntegrationRelativeTolerance <= 0.0)
+      {
+      this->ComputeSummedVolumeTable();
+      this->SetLookupTable(m_SummedVolumeTableGrid);
+      m_RadialTable = false;
+      }
+    else
+      {
+      this->SetLookupTable(this->GetScannedKernel());
+
+      // If the table is one slice thick in the xz-plane, assume radial
+      // interpolation is desired.
+      m_RadialTable =
+        this->GetScannedKernel()->GetLargestPossibleRegion().GetSize()[1] == 1;
+      }
+
+    // Generate the list of intersections of vertical lines and the
+    // sphere.
+    ComputeIntersections();
+    }
+
+  // The adaptive tolerance is relative to the convolution at the
+  // sphere center, which is near its peak.
+  if (m_IntegrationRelativeTolerance > 0.0)
+    {
+    OutputImagePointType center = m_SphereCenter;
+    m_IntegrationScale = fabs(this->ComputeSampleValue(center));
+    }
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::AfterThreadedGenerateData()
+{
+  m_NumberOfSampleEvaluations = 0;
+  for (unsigned int i = 0; i < m_SampleEvaluationsPerThread.size(); i++)
+    {
+    m_NumberOfSampleEvaluations += m_SampleEvaluationsPerThread[i];
+    }
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::SetLookupTable(const InputImageType* table)
+{
+  InputImageRegionType bufferedRegion = table->GetBufferedRegion();
+  m_TableBuffer = table->GetBufferPointer();
+  long stride = 1;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    long size = static_cast<long>(bufferedRegion.GetSize()[i]);
+    m_TableInverseSpacing[i] = 1.0 / table->GetSpacing()[i];
+    m_TableOrigin[i] = table->GetOrigin()[i] +
+      table->GetSpacing()[i]*static_cast<double>(bufferedRegion.GetIndex()[i]);
+    m_TableMaximumIndex[i] = static_cast<double>(size - 1);
+    m_TableLastCell[i] = size > 1 ? size - 2 : 0;
+    m_TableStride[i] = stride;
+    m_TableStep[i] = size > 1 ? stride : 0;
+    stride *= size;
+    }
+  m_TableSpacingZ = table->GetSpacing()[2];
+}
+
+
+template <class TInputImage, class TOutputImage>
+typename SphereConvolutionFilter<TInputImage,TOutputImage>::InputImagePointer
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ExpandKernel(const InputImageType* input) const
+{
+  InputImageType* kernel = const_cast<InputImageType*>(input);
+  InputImageRegionType kernelRegion = kernel->GetBufferedRegion();
+  InputImageSizeType   kernelSize   = kernelRegion.GetSize();
+  if (kernelSize[1] != 1)
+    {
+    return kernel;
+    }
+
+  // The radial kernel holds the profile along x in each z-plane.
+  // Sample it on a square grid centered on the z-axis.
+  SpacingType spacing = kernel->GetSpacing();
+  spacing[1] = spacing[0];
+  double radialOrigin = kernel->GetOrigin()[0] +
+    spacing[0]*static_cast<double>(kernelRegion.GetIndex()[0]);
+  double maxRadius = radialOrigin +
+    spacing[0]*static_cast<double>(kernelSize[0] - 1);
+  long halfSize = static_cast<long>(ceil(maxRadius / spacing[0]));
+
+  InputImageSizeType size;
+  size[0] = size[1] = 2*halfSize + 1;
+  size[2] = kernelSize[2];
+
+  InputImagePointType origin;
+  origin[0] = origin[1] = -spacing[0]*static_cast<double>(halfSize);
+  origin[2] = kernel->GetOrigin()[2] +
+    spacing[2]*static_cast<double>(kernelRegion.GetIndex()[2]);
+
+  InputImageRegionType region;
+  region.SetSize(size);
+
+  InputImagePointer expanded = InputImageType::New();
+  expanded->SetRegions(region);
+  expanded->SetSpacing(spacing);
+  expanded->SetOrigin(origin);
+  expanded->Allocate();
+
+  const InputImagePixelType* profile = kernel->GetBufferPointer();
+  InputImagePixelType* out = expanded->GetBufferPointer();
+  const long profileSize = static_cast<long>(kernelSize[0]);
+  for ( SizeValueType k = 0; k < size[2]; k++ )
+    {
+    const InputImagePixelType* row = profile + k*profileSize;
+    for ( long j = -halfSize; j <= halfSize; j++ )
+      {
+      for ( long i = -halfSize; i <= halfSize; i++ )
+        {
+        double r = sqrt(static_cast<double>(i*i + j*j))*spacing[0];
+        double c = (r - radialOrigin) / spacing[0];
+        double value = 0.0;
+        if (c >= 0.0 && c <= static_cast<double>(profileSize - 1))
+          {
+          long index = std::max(std::min(static_cast<long>(c), profileSize - 2), 0L);
+          long next  = std::min(index + 1, profileSize - 1);
+          double f = c - static_cast<double>(index);
+          value = row[index] + f*(row[next] - row[index]);
+          }
+        *out++ = static_cast<InputImagePixelType>(value);
+        }
+      }
+    }
+
+  return expanded;
+}
+
+
+template <class TInputImage, class TOutputImage>
+double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeSphereFraction(const double center[3], const double halfWidth[3]) const
+{
+  // Boxes entirely inside or outside the sphere need no subsampling.
+  double nearest = 0.0, farthest = 0.0;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    double d = fabs(center[i]);
+    double nearDistance = std::max(d - halfWidth[i], 0.0);
+    double farDistance  = d + halfWidth[i];
+    nearest  += nearDistance*nearDistance;
+    farthest += farDistance*farDistance;
+    }
+
+  double r2 = m_SphereRadius*m_SphereRadius;
+  if (farthest <= r2)
+    {
+    return 1.0;
+    }
+  if (nearest >= r2)
+    {
+    return 0.0;
+    }
+
+  unsigned int n = m_SphereSubsamples > 0 ? m_SphereSubsamples : 1;
+  double step[3];
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    step[i] = 2.0*halfWidth[i] / static_cast<double>(n);
+    }
+
+  unsigned long inside = 0;
+  for ( unsigned int k = 0; k < n; k++ )
+    {
+    double z = center[2] - halfWidth[2] + (k+0.5)*step[2];
+    for ( unsigned int j = 0; j < n; j++ )
+      {
+      double y = center[1] - halfWidth[1] + (j+0.5)*step[1];
+      double yz2 = y*y + z*z;
+      for ( unsigned int i = 0; i < n; i++ )
+        {
+        double x = center[0] - halfWidth[0] + (i+0.5)*step[0];
+        if (x*x + yz2 < r2)
+          {
+          inside++;
+          }
+        }
+      }
+    }
+
+  return static_cast<double>(inside) / static_cast<double>(n*n*n);
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeConvolutionTable()
+{
+  // The table depends only on the kernel and the sphere, so it is
+  // reused when only the sphere center or the output sampling change.
+  const InputImageType* input = this->GetInput();
+  if (m_ConvolutionTable &&
+      m_ConvolutionTableKernel == input &&
+      m_ConvolutionTableKernelMTime == input->GetMTime() &&
+      m_ConvolutionTableRadius == m_SphereRadius &&
+      m_ConvolutionTableSubsamples == m_SphereSubsamples)
+    {
+    return;
+    }
+
+  InputImagePointer kernel = this->ExpandKernel(this->GetInput());
+  SpacingType spacing = kernel->GetSpacing();
+  InputImageRegionType kernelBufferedRegion = kernel->GetBufferedRegion();
+  InputImageSizeType kernelSize = kernelBufferedRegion.GetSize();
+
+  // The sphere image covers the voxels within one radius of the
+  // center. Pad both images to a power of two at least as large as
+  // the linear convolution so that the cyclic convolution computed
+  // through the FFT does not wrap around.
+  double radius = std::max(m_SphereRadius, 0.0);
+  long sphereHalfSize[3];
+  InputImageSizeType paddedSize;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    sphereHalfSize[i] = static_cast<long>(ceil(radius / spacing[i]));
+    SizeValueType convolutionSize = kernelSize[i] + 2*sphereHalfSize[i];
+    paddedSize[i] = 1;
+    while (paddedSize[i] < convolutionSize)
+      {
+      paddedSize[i] *= 2;
+      }
+    }
+
+  InputImageRegionType paddedRegion;
+  paddedRegion.SetSize(paddedSize);
+
+  InputImagePointer paddedKernel = InputImageType::New();
+  paddedKernel->SetRegions(paddedRegion);
+  paddedKernel->SetSpacing(spacing);
+  paddedKernel->Allocate();
+  paddedKernel->FillBuffer(NumericTraits<InputImagePixelType>::Zero);
+
+  InputImageRegionType kernelRegion;
+  kernelRegion.SetSize(kernelSize);
+  ImageRegionConstIterator<InputImageType>
+    kernelIt(kernel, kernelBufferedRegion);
+  ImageRegionIterator<InputImageType>
+    paddedKernelIt(paddedKernel, kernelRegion);
+  for (; !kernelIt.IsAtEnd(); ++kernelIt, ++paddedKernelIt)
+    {
+    paddedKernelIt.Set(kernelIt.Get());
+    }
+
+  // Partial-volume image of the sphere. Voxel (i,j,k) is centered at
+  // offset (i - h[0], j - h[1], k - h[2]) * spacing from the sphere
+  // center, where h is the half size of the sphere image.
+  InputImagePointer sphere = InputImageType::New();
+  sphere->SetRegions(paddedRegion);
+  sphere->SetSpacing(spacing);
+  sphere->Allocate();
+  sphere->FillBuffer(NumericTraits<InputImagePixelType>::Zero);
+
+  double halfWidth[3];
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    halfWidth[i] = 0.5*spacing[i];
+    }
+
+  InputImageIndexType index;
+  for ( long k = 0; k <= 2*sphereHalfSize[2]; k++ )
+    {
+    index[2] = k;
+    for ( long j = 0; j <= 2*sphereHalfSize[1]; j++ )
+      {
+      index[1] = j;
+      for ( long i = 0; i <= 2*sphereHalfSize[0]; i++ )
+        {
+        index[0] = i;
+        double center[3];
+        center[0] = static_cast<double>(i - sphereHalfSize[0])*spacing[0];
+        center[1] = static_cast<double>(j - sphereHalfSize[1])*spacing[1];
+        center[2] = static_cast<double>(k - sphereHalfSize[2])*spacing[2];
+        sphere->SetPixel(index, static_cast<InputImagePixelType>
+                         (this->ComputeSphereFraction(center, halfWidth)));
+        }
+      }
+    }
+
+  typename ForwardFFTType::Pointer kernelFFT = ForwardFFTType::New();
+  kernelFFT->SetInput(paddedKernel);
+  kernelFFT->Update();
+
+  typename ForwardFFTType::Pointer sphereFFT = ForwardFFTType::New();
+  sphereFFT->SetInput(sphere);
+  sphereFFT->Update();
+
+  // The chord method sums the kernel samples along z and over lines
+  // m_LineSampleSpacing apart in x and y. Scale the product so that
+  // both methods produce the same intensities.
+  InputImagePixelType scale = static_cast<InputImagePixelType>
+    (spacing[0]*spacing[1] / (m_LineSampleSpacing*m_LineSampleSpacing));
+
+  typename ComplexImageType::Pointer product = kernelFFT->GetOutput();
+  ImageRegionIterator<ComplexImageType>
+    productIt(product, product->GetBufferedRegion());
+  ImageRegionConstIterator<ComplexImageType>
+    sphereIt(sphereFFT->GetOutput(), product->GetBufferedRegion());
+  for (; !productIt.IsAtEnd(); ++productIt, ++sphereIt)
+    {
+    productIt.Set(productIt.Get() * sphereIt.Get() * scale);
+    }
+
+  typename InverseFFTType::Pointer inverseFFT = InverseFFTType::New();
+  inverseFFT->SetInput(product);
+  inverseFFT->SetActualXDimensionIsOdd(paddedSize[0] % 2 == 1);
+  inverseFFT->Update();
+
+  // Voxel i of the result is the convolution at offset
+  // (kernel origin + (i - h) * spacing) from the sphere center. The
+  // padding beyond the linear convolution holds zeros.
+  InputImagePointType origin;
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    origin[i] = kernel->GetOrigin()[i] + spacing[i]*static_cast<double>
+      (kernelBufferedRegion.GetIndex()[i] - sphereHalfSize[i]);
+    }
+
+  m_ConvolutionTable = inverseFFT->GetOutput();
+  m_ConvolutionTable->DisconnectPipeline();
+  m_ConvolutionTable->SetSpacing(spacing);
+  m_ConvolutionTable->SetOrigin(origin);
+
+  m_ConvolutionTableKernel = input;
+  m_ConvolutionTableKernelMTime = input->GetMTime();
+  m_ConvolutionTableRadius = m_SphereRadius;
+  m_ConvolutionTableSubsamples = m_SphereSubsamples;
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::IntegrateLine(double* line, long length, long stride)
+{
+  double previous = line[0];
+  line[0] = 0.0;
+  for ( long i = 1; i < length; i++ )
+    {
+    double current = line[i*stride];
+    line[i*stride] = line[(i-1)*stride] + 0.5*(previous + current);
+    previous = current;
+    }
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeSummedVolumeTable()
+{
+  const InputImageType* scan = this->GetScannedKernel();
+  if (!m_SummedVolumeTable.empty() &&
+      m_SummedVolumeTableKernel == scan &&
+      m_SummedVolumeTableKernelMTime == scan->GetMTime())
+    {
+    return;
+    }
+
+  m_SummedVolumeTableGrid = this->ExpandKernel(scan);
+  InputImageSizeType size = m_SummedVolumeTableGrid->GetBufferedRegion().GetSize();
+  const long nx = static_cast<long>(size[0]);
+  const long ny = static_cast<long>(size[1]);
+  const long nz = static_cast<long>(size[2]);
+  const long planeSize = nx*ny;
+
+  const InputImagePixelType* values = m_SummedVolumeTableGrid->GetBufferPointer();
+  m_SummedVolumeTable.assign(values, values + planeSize*nz);
+  double* table = &m_SummedVolumeTable[0];
+
+  // Integrate along x and y, keep the top plane to extend the table
+  // above its top where the scan is constant, then integrate along z.
+  for ( long k = 0; k < nz; k++ )
+    {
+    for ( long j = 0; j < ny; j++ )
+      {
+      IntegrateLine(table + k*planeSize + j*nx, nx, 1);
+      }
+    for ( long i = 0; i < nx; i++ )
+      {
+      IntegrateLine(table + k*planeSize + i, ny, nx);
+      }
+    }
+
+  m_SummedTopPlane.assign(table + (nz-1)*planeSize, table + nz*planeSize);
+
+  for ( long j = 0; j < ny; j++ )
+    {
+    for ( long i = 0; i < nx; i++ )
+      {
+      IntegrateLine(table + j*nx + i, nz, planeSize);
+      }
+    }
+
+  m_SummedVolumeTableKernel = scan;
+  m_SummedVolumeTableKernelMTime = scan->GetMTime();
+}
+
+
+template <class TInputImage, class TOutputImage>
+inline double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::EvaluateSummedVolume(double cx, double cy, double cz) const
+{
+  // The scan is zero outside the table in x and y and below it in z,
+  // and constant above it.
+  if (cz <= 0.0)
+    {
+    return 0.0;
+    }
+  cx = std::min(std::max(cx, 0.0), m_TableMaximumIndex[0]);
+  cy = std::min(std::max(cy, 0.0), m_TableMaximumIndex[1]);
+
+  const double maxZ = m_TableMaximumIndex[2];
+  if (cz <= maxZ)
+    {
+    return this->InterpolateTable(&m_SummedVolumeTable[0], cx, cy, cz);
+    }
+
+  long ix = std::min(static_cast<long>(cx), m_TableLastCell[0]);
+  long iy = std::min(static_cast<long>(cy), m_TableLastCell[1]);
+  double fx = cx - static_cast<double>(ix);
+  double fy = cy - static_cast<double>(iy);
+  const double* p = &m_SummedTopPlane[0] + ix*m_TableStride[0] + iy*m_TableStride[1];
+  const long dx = m_TableStep[0];
+  const long dy = m_TableStep[1];
+  double c0 = p[0]  + fx*(p[dx]      - p[0]);
+  double c1 = p[dy] + fx*(p[dy + dx] - p[dy]);
+  double top = c0 + fy*(c1 - c0);
+
+  return this->InterpolateTable(&m_SummedVolumeTable[0], cx, cy, maxZ) +
+    (cz - maxZ)*top;
+}
+
+
+template <class TInputImage, class TOutputImage>
+double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeBoxIntegral(const OutputImagePointType& center,
+                     const OutputImageSpacingType& size)
+{
+  // Box bounds relative to the sphere center, in table voxels.
+  double lower[3], upper[3];
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    lower[i] = (center[i] - m_SphereCenter[i] - 0.5*size[i] - m_TableOrigin[i]) *
+      m_TableInverseSpacing[i];
+    upper[i] = lower[i] + size[i]*m_TableInverseSpacing[i];
+    }
+
+  double value = 0.0;
+  const size_t numIntersections = m_IntersectionX.size();
+  for ( size_t i = 0; i < numIntersections; i++ )
+    {
+    double x0 = lower[0] - m_IntersectionX[i]*m_TableInverseSpacing[0];
+    double x1 = upper[0] - m_IntersectionX[i]*m_TableInverseSpacing[0];
+    double y0 = lower[1] - m_IntersectionY[i]*m_TableInverseSpacing[1];
+    double y1 = upper[1] - m_IntersectionY[i]*m_TableInverseSpacing[1];
+
+    // As in ComputeSampleValue(), the lower intersection is offset by
+    // one table voxel.
+    double z[2];
+    z[0] = m_IntersectionZ1[i]*m_TableInverseSpacing[2];
+    z[1] = m_IntersectionZ2[i]*m_TableInverseSpacing[2] + 1.0;
+
+    double box[2];
+    for ( unsigned int e = 0; e < 2; e++ )
+      {
+      double z0 = lower[2] - z[e];
+      double z1 = upper[2] - z[e];
+      box[e] =
+        this->EvaluateSummedVolume(x1, y1, z1) - this->EvaluateSummedVolume(x0, y1, z1) -
+        this->EvaluateSummedVolume(x1, y0, z1) + this->EvaluateSummedVolume(x0, y0, z1) -
+        this->EvaluateSummedVolume(x1, y1, z0) + this->EvaluateSummedVolume(x0, y1, z0) +
+        this->EvaluateSummedVolume(x1, y0, z0) - this->EvaluateSummedVolume(x0, y0, z0);
+      }
 
-  // Set the inputs for the interpolators
-  m_TableInterpolator->SetInputImage(m_ScanImageFilter->GetOutput());
+    value += box[0] - box[1];
+    }
 
-  // Generate the list of intersections of vertical lines and the
-  // sphere.
-  ComputeIntersections();
+  return value / (m_TableInverseSpacing[0]*m_TableInverseSpacing[1]*m_TableInverseSpacing[2]);
 }
 
 
@@ -230,43 +880,147 @@ template <class TInputImage, class TOutputImage>
 void
 SphereConvolutionFilter<TInputImage,TOutputImage>
 ::ThreadedGenerateData
-(const OutputImageRegionType& outputRegionForThread, int threadId)
+(const OutputImageRegionType& itkNotUsed(outputRegionForThread), int threadId)
 {
-  // Support progress methods/callbacks
-  ProgressReporter progress(this, threadId, outputRegionForThread.GetNumberOfPixels());
   OutputImagePointer image = this->GetOutput(0);
 
-  ImageRegionIteratorWithIndex<TOutputImage> it(image, outputRegionForThread);
-
   SpacingType dx;
   double volume = 1.0;
   unsigned int dimension = this->m_WeightIntegrationByArea ? ImageDimension - 1 : ImageDimension;
-  for ( unsigned int i = 0; i < dimension; i++ )
+  for ( unsigned int i = 0; i < ImageDimension; i++ )
     {
     dx[i] = this->GetSpacing()[i]
       / static_cast< SpacingValueType >(m_NumberOfIntegrationSamples[i]);
-    volume *= dx[i];
+    if ( i < dimension )
+      {
+      volume *= dx[i];
+      }
     }
 
-  for (; !it.IsAtEnd(); ++it)
+  // Profiles are valid for radially symmetric kernels. They are kept
+  // for the current slice only.
+  bool useAdaptive = m_IntegrationRelativeTolerance > 0.0;
+  bool useTable = m_UseSummedVolumeTable && !useAdaptive &&
+    m_ConvolutionMethod == CHORD_CONVOLUTION;
+  bool useProfiles = m_ConvolutionMethod == CHORD_CONVOLUTION &&
+    !useTable && !useAdaptive && m_RadialTable && m_RadialProfileSpacing > 0.0;
+  RadialProfileCache profileCache;
+  long profileSlice = 0;
+  bool profileCacheValid = false;
+
+  // The chord method without a summed-volume table sweeps the chords
+  // over all samples of a tile at once.
+  bool useTiles = m_ConvolutionMethod == CHORD_CONVOLUTION &&
+    !useTable && !useProfiles && !useAdaptive && m_SphereRadius >= 0.0;
+  ChordTileBuffer tileBuffer;
+
+  // Adaptive integration yields the mean over the voxel, which is
+  // scaled as the sum of the uniform samples would be.
+  const unsigned long samplesPerVoxel = m_NumberOfIntegrationSamples[0] *
+    m_NumberOfIntegrationSamples[1] * m_NumberOfIntegrationSamples[2];
+  const double meanScale = volume * static_cast<double>(samplesPerVoxel);
+  const double tolerance = m_IntegrationRelativeTolerance * m_IntegrationScale;
+  SpacingType halfWidth;
+  for ( unsigned int i = 0; i < ImageDimension; i++ )
     {
-    OutputImageIndexType index = it.GetIndex();
-    OutputImagePointType point;
-    image->TransformIndexToPhysicalPoint(index, point);
+    halfWidth[i] = 0.5 * this->GetSpacing()[i];
+    }
 
-    // Change the z coordinate here if using custom z coordinates
-    if (m_UseCustomZCoordinates)
+  unsigned long evaluations = 0;
+
+  OutputImageRegionType tile;
+  while ( m_Scheduler->GetNextTile(threadId, tile) )
+    {
+    if (useTiles)
       {
-      point[2] = GetZCoordinate(index[2]);
+      this->ComputeTileByChords(tile, dx, volume, tileBuffer);
+      evaluations += samplesPerVoxel * tile.GetNumberOfPixels();
+      m_Scheduler->ReportProgress(this, threadId);
+      continue;
       }
 
-    // Apply shear here
-    point[0] -= m_ShearX * (point[2] - m_SphereCenter[2]);
-    point[1] -= m_ShearY * (point[2] - m_SphereCenter[2]);
+    ImageRegionIteratorWithIndex<TOutputImage> it(image, tile);
+    for (; !it.IsAtEnd(); ++it)
+      {
+      OutputImageIndexType index = it.GetIndex();
+      OutputImagePointType point;
+      image->TransformIndexToPhysicalPoint(index, point);
+
+      // Change the z coordinate here if using custom z coordinates
+      if (m_UseCustomZCoordinates)
+        {
+        point[2] = GetZCoordinate(index[2]);
+        }
+
+      // Apply shear here
+      point[0] -= m_ShearX * (point[2] - m_SphereCenter[2]);
+      point[1] -= m_ShearY * (point[2] - m_SphereCenter[2]);
+
+      if (useAdaptive)
+        {
+        double centerValue = ComputeSampleValue(point);
+        evaluations++;
+        it.Set( m_OutputShift + m_OutputScale * meanScale *
+                ComputeAdaptiveVoxelValue(point, halfWidth, centerValue,
+                                          tolerance, 0, evaluations) );
+        }
+      else if (useProfiles)
+        {
+        if (!profileCacheValid || index[2] != profileSlice)
+          {
+          profileCache.z.clear();
+          profileCache.profiles.clear();
+          profileSlice = index[2];
+          profileCacheValid = true;
+          }
+        it.Set( m_OutputShift + m_OutputScale * volume *
+                ComputeIntegratedVoxelValueFromProfiles(point, dx, profileCache) );
+        evaluations += samplesPerVoxel;
+        }
+      else
+        {
+        it.Set( m_OutputShift + m_OutputScale * volume *
+                ComputeIntegratedVoxelValue(point, dx) );
+        evaluations += useTable ? 1 : samplesPerVoxel;
+        }
+      }
 
-    it.Set( volume * ComputeIntegratedVoxelValue(point, dx) );
-    progress.CompletedPixel();
+    m_Scheduler->ReportProgress(this, threadId);
     }
+
+  m_SampleEvaluationsPerThread[threadId] += evaluations;
+}
+
+
+template <class TInputImage, class TOutputImage>
+template <class TValue>
+inline double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::InterpolateTable(const TValue* table, double cx, double cy, double cz) const
+{
+  // Lower corner of the interpolation cell. Along dimensions of size
+  // one the fraction is zero and both corners coincide.
+  long ix = std::min(static_cast<long>(cx), m_TableLastCell[0]);
+  long iy = std::min(static_cast<long>(cy), m_TableLastCell[1]);
+  long iz = std::min(static_cast<long>(cz), m_TableLastCell[2]);
+  double fx = cx - static_cast<double>(ix);
+  double fy = cy - static_cast<double>(iy);
+  double fz = cz - static_cast<double>(iz);
+
+  const TValue* p = table +
+    ix*m_TableStride[0] + iy*m_TableStride[1] + iz*m_TableStride[2];
+  const long dx = m_TableStep[0];
+  const long dy = m_TableStep[1];
+  const long dz = m_TableStep[2];
+
+  double c00 = p[0]       + fx*(p[dx]          - p[0]);
+  double c10 = p[dy]      + fx*(p[dy + dx]     - p[dy]);
+  double c01 = p[dz]      + fx*(p[dz + dx]     - p[dz]);
+  double c11 = p[dz + dy] + fx*(p[dz + dy + dx] - p[dz + dy]);
+  double c0  = c00 + fy*(c10 - c00);
+  double c1  = c01 + fy*(c11 - c01);
+
+  return c0 + fz*(c1 - c0);
 }
 
 
@@ -275,80 +1029,194 @@ double
 SphereConvolutionFilter<TInputImage,TOutputImage>
 ::ComputeSampleValue(OutputImagePointType& point)
 {
-  double value = 0.0f;
+  double value = 0.0;
 
   if (m_SphereRadius < 0.0)
     {
     return value;
     }
 
-  // Compute maximum z value in the pre-integrated table.
-  InputImagePointer scannedImage = m_ScanImageFilter->GetOutput();
-  double tableZMax = (scannedImage->GetSpacing()[2] *
-              static_cast<double>(scannedImage->GetLargestPossibleRegion().GetSize()[2]-1)) + scannedImage->GetOrigin()[2];
+  if (m_ConvolutionMethod == FFT_CONVOLUTION)
+    {
+    return this->ComputeFFTSampleValue(point);
+    }
+
+  double x = point[0] - m_SphereCenter[0];
+  double y = point[1] - m_SphereCenter[1];
+  double z = point[2] - m_SphereCenter[2];
+  this->AccumulateChordSums(&x, &y, &z, 1, &value);
+
+  return value;
+}
+
 
-  IntersectionArrayConstIterator iter;
-  for ( IntersectionArrayConstIterator iter = m_IntersectionArray.begin();
-        iter != m_IntersectionArray.end();
-        iter++)
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::AccumulateChordSums(const double* x, const double* y, const double* z,
+                      size_t n, double* sums) const
+{
+  const double maxX = m_TableMaximumIndex[0];
+  const double maxY = m_TableMaximumIndex[1];
+  const double maxZ = m_TableMaximumIndex[2];
+
+  // Continuous z index just below the top of the table, used for lines
+  // that leave the table through its top.
+  const double topZ = std::max(maxZ - 1e-5*m_TableInverseSpacing[2], 0.0);
+
+  // In the radial case the y index is the same for all intersections.
+  const double radialY = -m_TableOrigin[1]*m_TableInverseSpacing[1];
+
+  const size_t numIntersections = m_IntersectionX.size();
+  if ( numIntersections == 0 || n == 0 )
     {
-    SphereIntersection intersection = *iter;
-    double xs = intersection.x  + m_SphereCenter[0];
-    double ys = intersection.y  + m_SphereCenter[1];
-    double z1 = intersection.z1 + m_SphereCenter[2];
-    double z2 = intersection.z2 + m_SphereCenter[2];
-    int numIntersections = intersection.numIntersections;
+    return;
+    }
+
+  const double* xs  = &m_IntersectionX[0];
+  const double* ys  = &m_IntersectionY[0];
+  const double* z1s = &m_IntersectionZ1[0];
+  const double* z2s = &m_IntersectionZ2[0];
 
-    // Find the intersection z-coordinate values, if they exist.
-    double x = point[0];
-    double y = point[1];
-    double z = point[2];
+  for ( size_t i = 0; i < numIntersections; i++ )
+    {
+    // The z-voxel spacing is subtracted from the lower intersection to
+    // get the proper behavior in the pre-integrated PSF table.
+    const double z1Offset = -z1s[i] - m_TableOrigin[2];
+    const double z2Offset = -z2s[i] - m_TableOrigin[2] - m_TableSpacingZ;
 
-    if (numIntersections == 2)
+    for ( size_t s = 0; s < n; s++ )
       {
-      Point<float, ImageDimension> p1, p2;
-      p1[0] = x - xs;   p1[1] = y - ys;   p1[2] = z - z1;
-      p2[0] = x - xs;   p2[1] = y - ys;   p2[2] = z - z2;
-
-      // If the input image is one slice thick in the xz-plane, assume
-      // radial interpolation is desired and change the lookup table
-      // accordingly.
-      if ( this->GetInput()->GetLargestPossibleRegion().GetSize()[1] == 1 )
+      double px = x[s] - xs[i];
+      double py = y[s] - ys[i];
+      double cx, cy;
+      if ( m_RadialTable )
+        {
+        cx = (sqrt(px*px + py*py) - m_TableOrigin[0])*m_TableInverseSpacing[0];
+        cy = radialY;
+        }
+      else
         {
-        double r = sqrt(p2[0]*p2[0] + p2[1]*p2[1]);
-        p1[0] = r; p1[1] = 0.0;
-        p2[0] = r; p2[1] = 0.0;
+        cx = (px - m_TableOrigin[0])*m_TableInverseSpacing[0];
+        cy = (py - m_TableOrigin[1])*m_TableInverseSpacing[1];
         }
 
-      // Important: z1 is always less than z2, so p1 is always above p2
+      // Important: z1 is always less than z2, so cz1 is always above cz2
+      double cz1 = (z[s] + z1Offset)*m_TableInverseSpacing[2];
+      double cz2 = (z[s] + z2Offset)*m_TableInverseSpacing[2];
 
-      // Subtract z-voxel spacing from p2[2] to get the proper behavior
-      // in the pre-integrated PSF table.
-      p2[2] -= scannedImage->GetSpacing()[2];
+      // A lookup outside the table contributes zero, except that a line
+      // leaving through the top of the table takes the top value.
+      bool insideXY = (cx >= 0.0) & (cx <= maxX) & (cy >= 0.0) & (cy <= maxY);
+      bool inside2  = insideXY & (cz2 >= 0.0) & (cz2 <= maxZ);
+      bool inside1  = insideXY & (cz1 >= 0.0) & ((cz1 <= maxZ) | inside2);
 
-      // Get values from the pre-integrated table
-      typename InterpolatorType::ContinuousIndexType p1Index, p2Index;
-      bool v1Inside = m_TableInterpolator->GetInputImage()->
-        TransformPhysicalPointToContinuousIndex(p1, p1Index);
-      bool v2Inside = m_TableInterpolator->GetInputImage()->
-        TransformPhysicalPointToContinuousIndex(p2, p2Index);
-      InputImagePixelType v1 = 0.0;
-      InputImagePixelType v2 = 0.0;
-      if (v1Inside) v1 = m_TableInterpolator->EvaluateAtContinuousIndex(p1Index);
-      if (v2Inside) v2 = m_TableInterpolator->EvaluateAtContinuousIndex(p2Index);
+      // Clamp so that the lookups stay within the buffer; values from
+      // outside lookups are discarded below.
+      cx  = std::min(std::max(cx, 0.0), maxX);
+      cy  = std::min(std::max(cy, 0.0), maxY);
+      cz1 = cz1 > maxZ ? topZ : std::max(cz1, 0.0);
+      cz2 = std::min(std::max(cz2, 0.0), maxZ);
 
-      if (!v1Inside && v2Inside && p1[2] > tableZMax)
+      double v1 = InterpolateTable(m_TableBuffer, cx, cy, cz1);
+      double v2 = InterpolateTable(m_TableBuffer, cx, cy, cz2);
+
+      // z - z1 is always larger than z - z2, and integration goes along
+      // positive z, so we add v1 - v2.
+      sums[s] += (inside1 ? v1 : 0.0) - (inside2 ? v2 : 0.0);
+      }
+    }
+}
+
+
+template <class TInputImage, class TOutputImage>
+void
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeTileByChords(const OutputImageRegionType& tile, const SpacingType& dx,
+                      double volume, ChordTileBuffer& buffer)
+{
+  OutputImagePointer image = this->GetOutput(0);
+
+  const size_t samplesPerVoxel = m_NumberOfIntegrationSamples[0] *
+    m_NumberOfIntegrationSamples[1] * m_NumberOfIntegrationSamples[2];
+  const size_t numSamples = samplesPerVoxel * tile.GetNumberOfPixels();
+
+  buffer.x.resize(numSamples);
+  buffer.y.resize(numSamples);
+  buffer.z.resize(numSamples);
+  buffer.sums.assign(numSamples, 0.0);
+
+  // Gather the sample points of the voxels in the tile, relative to
+  // the sphere center.
+  size_t s = 0;
+  ImageRegionIteratorWithIndex<TOutputImage> it(image, tile);
+  for (; !it.IsAtEnd(); ++it)
+    {
+    OutputImageIndexType index = it.GetIndex();
+    OutputImagePointType point;
+    image->TransformIndexToPhysicalPoint(index, point);
+
+    if (m_UseCustomZCoordinates)
+      {
+      point[2] = GetZCoordinate(index[2]);
+      }
+
+    point[0] -= m_ShearX * (point[2] - m_SphereCenter[2]);
+    point[1] -= m_ShearY * (point[2] - m_SphereCenter[2]);
+
+    for ( SizeValueType k = 0; k < m_NumberOfIntegrationSamples[2]; k++ )
+      {
+      double z = point[2]-(0.5*this->GetSpacing()[2]) + (k+0.5)*dx[2] - m_SphereCenter[2];
+      for ( SizeValueType j = 0; j < m_NumberOfIntegrationSamples[1]; j++ )
         {
-        p1[2] = tableZMax - 1e-5;
-        v1 = m_TableInterpolator->Evaluate(p1);
+        double y = point[1]-(0.5*this->GetSpacing()[1]) + (j+0.5)*dx[1] - m_SphereCenter[1];
+        for ( SizeValueType i = 0; i < m_NumberOfIntegrationSamples[0]; i++ )
+          {
+          buffer.x[s] = point[0]-(0.5*this->GetSpacing()[0]) + (i+0.5)*dx[0] - m_SphereCenter[0];
+          buffer.y[s] = y;
+          buffer.z[s] = z;
+          s++;
+          }
         }
-      // z - z1 is always larger than z - z2, and integration goes along
-      // positive z, so we return v1 - v2.
-      value += v1 - v2;
       }
     }
 
-  return value;
+  if (numSamples > 0)
+    {
+    this->AccumulateChordSums(&buffer.x[0], &buffer.y[0], &buffer.z[0],
+                              numSamples, &buffer.sums[0]);
+    }
+
+  // Sum the samples of each voxel.
+  s = 0;
+  for (it.GoToBegin(); !it.IsAtEnd(); ++it)
+    {
+    double sum = 0.0;
+    for ( size_t k = 0; k < samplesPerVoxel; k++ )
+      {
+      sum += buffer.sums[s++];
+      }
+    it.Set( m_OutputShift + m_OutputScale * volume * sum );
+    }
+}
+
+
+template <class TInputImage, class TOutputImage>
+double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeFFTSampleValue(OutputImagePointType& point)
+{
+  double c[3];
+  for ( unsigned int i = 0; i < 3; i++ )
+    {
+    c[i] = (point[i] - m_SphereCenter[i] - m_TableOrigin[i])*m_TableInverseSpacing[i];
+    if (c[i] < 0.0 || c[i] > m_TableMaximumIndex[i])
+      {
+      return 0.0;
+      }
+    }
+
+  return this->InterpolateTable(m_TableBuffer, c[0], c[1], c[2]);
 }
 
 
@@ -357,6 +1225,17 @@ double
 SphereConvolutionFilter<TInputImage,TOutputImage>
 ::ComputeIntegratedVoxelValue(OutputImagePointType& point, const SpacingType& dx)
 {
+  // The box integral equals the limit of the sample sum times the
+  // sample volume.
+  if (m_UseSummedVolumeTable && m_ConvolutionMethod == CHORD_CONVOLUTION)
+    {
+    if (m_SphereRadius < 0.0)
+      {
+      return 0.0;
+      }
+    return this->ComputeBoxIntegral(point, this->GetSpacing()) / (dx[0]*dx[1]*dx[2]);
+    }
+
   // Riemannian integration over a voxel
   double sum = 0.0;
 
@@ -381,6 +1260,126 @@ SphereConvolutionFilter<TInputImage,TOutputImage>
 }
 
 
+template <class TInputImage, class TOutputImage>
+double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeAdaptiveVoxelValue(const OutputImagePointType& center,
+                            const SpacingType& halfWidth,
+                            double centerValue, double tolerance,
+                            unsigned int depth, unsigned long& evaluations)
+{
+  if (depth >= m_MaximumIntegrationDepth)
+    {
+    return centerValue;
+    }
+
+  // Sample the centers of the octants.
+  SpacingType childHalfWidth;
+  for ( unsigned int i = 0; i < ImageDimension; i++ )
+    {
+    childHalfWidth[i] = 0.5 * halfWidth[i];
+    }
+
+  OutputImagePointType childCenters[8];
+  double childValues[8];
+  double mean = 0.0;
+  for ( unsigned int c = 0; c < 8; c++ )
+    {
+    for ( unsigned int i = 0; i < 3; i++ )
+      {
+      childCenters[c][i] = center[i] +
+        ((c >> i) & 1 ? childHalfWidth[i] : -childHalfWidth[i]);
+      }
+    childValues[c] = ComputeSampleValue(childCenters[c]);
+    mean += childValues[c];
+    }
+  mean *= 0.125;
+  evaluations += 8;
+
+  if (fabs(mean - centerValue) <= tolerance)
+    {
+    return mean;
+    }
+
+  // Refine the octants. Each octant meeting the tolerance keeps the
+  // mean within it.
+  double sum = 0.0;
+  for ( unsigned int c = 0; c < 8; c++ )
+    {
+    sum += this->ComputeAdaptiveVoxelValue(childCenters[c], childHalfWidth,
+                                           childValues[c], tolerance,
+                                           depth + 1, evaluations);
+    }
+
+  return 0.125 * sum;
+}
+
+
+template <class TInputImage, class TOutputImage>
+double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::ComputeIntegratedVoxelValueFromProfiles(OutputImagePointType& point,
+                                          const SpacingType& dx,
+                                          RadialProfileCache& cache)
+{
+  double sum = 0.0;
+
+  for ( SizeValueType k = 0; k < m_NumberOfIntegrationSamples[2]; k++ )
+    {
+    double z = point[2]-(0.5*this->GetSpacing()[2]) + (k+0.5)*dx[2];
+
+    // Find the profile for this z-coordinate.
+    size_t p = 0;
+    while (p < cache.z.size() && cache.z[p] != z)
+      {
+      p++;
+      }
+    if (p == cache.z.size())
+      {
+      cache.z.push_back(z);
+      cache.profiles.push_back(std::vector<double>());
+      }
+    std::vector<double>& profile = cache.profiles[p];
+
+    for ( SizeValueType j = 0; j < m_NumberOfIntegrationSamples[1]; j++ )
+      {
+      double y = point[1]-(0.5*this->GetSpacing()[1]) + (j+0.5)*dx[1] - m_SphereCenter[1];
+      for ( SizeValueType i = 0; i < m_NumberOfIntegrationSamples[0]; i++ )
+        {
+        double x = point[0]-(0.5*this->GetSpacing()[0]) + (i+0.5)*dx[0] - m_SphereCenter[0];
+        sum += this->EvaluateRadialProfile(profile, z, sqrt(x*x + y*y));
+        }
+      }
+    }
+
+  return sum;
+}
+
+
+template <class TInputImage, class TOutputImage>
+double
+SphereConvolutionFilter<TInputImage,TOutputImage>
+::EvaluateRadialProfile(std::vector<double>& profile, double z, double rho)
+{
+  double c = rho / m_RadialProfileSpacing;
+  size_t index = static_cast<size_t>(c);
+
+  // Evaluate the chords at the profile points up to the one beyond rho.
+  while (profile.size() < index + 2)
+    {
+    OutputImagePointType samplePoint;
+    samplePoint[0] = m_SphereCenter[0] +
+      m_RadialProfileSpacing*static_cast<double>(profile.size());
+    samplePoint[1] = m_SphereCenter[1];
+    samplePoint[2] = z;
+    profile.push_back(this->ComputeSampleValue(samplePoint));
+    }
+
+  double f = c - static_cast<double>(index);
+  return profile[index] + f*(profile[index+1] - profile[index]);
+}
+
+
 template <class TInputImage, class TOutputImage>
 void
 SphereConvolutionFilter<TInputImage,TOutputImage>
@@ -417,6 +1416,19 @@ SphereConvolutionFilter<TInputImage,TOutputImage>
 
   os << indent << "SphereRadius: " << m_SphereRadius << std::endl;
 
+  os << indent << "ConvolutionMethod: "
+     << (m_ConvolutionMethod == FFT_CONVOLUTION ? "FFT" : "Chords") << std::endl;
+  os << indent << "SphereSubsamples: " << m_SphereSubsamples << std::endl;
+  os << indent << "UseSummedVolumeTable: " << m_UseSummedVolumeTable << std::endl;
+  os << indent << "RadialProfileSpacing: " << m_RadialProfileSpacing << std::endl;
+  os << indent << "OutputShift: " << m_OutputShift << std::endl;
+  os << indent << "OutputScale: " << m_OutputScale << std::endl;
+  os << indent << "IntegrationRelativeTolerance: "
+     << m_IntegrationRelativeTolerance << std::endl;
+  os << indent << "MaximumIntegrationDepth: " << m_MaximumIntegrationDepth << std::endl;
+  os << indent << "NumberOfSampleEvaluations: "
+     << m_NumberOfSampleEvaluations << std::endl;
+
 }
 
 
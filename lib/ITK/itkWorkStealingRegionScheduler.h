@@ -0,0 +1,171 @@
+/*=========================================================================
+ *
+ *  Copyright Insight Software Consortium
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *         http://www.apache.org/licenses/LICENSE-2.0.txt
+ *
+ *  Unless required by applicable law or agreed to in writing, software
+ *  distributed under the License is distributed on an "AS IS" BASIS,
+ *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ *
+ *=========================================================================*/
+#ifndef __itkWorkStealingRegionScheduler_h
+#define __itkWorkStealingRegionScheduler_h
+
+#include "itkObject.h"
+#include "itkObjectFactory.h"
+#include "itkProcessObject.h"
+#include "itkRealTimeClock.h"
+#include "itkSimpleFastMutexLock.h"
+
+#include <deque>
+#include <vector>
+
+namespace itk
+{
+
+/** \class WorkStealingRegionScheduler
+ *
+ * \brief Hands out tiles of an output region to the threads of a
+ * filter, letting idle threads steal tiles from busy ones.
+ *
+ * The static split of the output region into one slab per thread
+ * balances the load poorly when the cost per pixel varies across the
+ * image. A filter using this class queues the tiles of each thread's
+ * slab in BeforeThreadedGenerateData() and, in ThreadedGenerateData(),
+ * processes tiles obtained from GetNextTile() until there are none
+ * left. A thread takes tiles from the front of its own queue, so it
+ * traverses its slab in order, and a thread with an empty queue steals
+ * from the back of the longest queue of another thread.
+ *
+ * The scheduler records the time each thread spends on its tiles, the
+ * number of tiles it processed, and the number it stole, which shows
+ * how well the load was balanced in the last update.
+ *
+ * \ingroup Multithreaded
+ */
+template <class TRegion>
+class ITK_EXPORT WorkStealingRegionScheduler : public Object
+{
+public:
+  /** Standard class typedefs. */
+  typedef WorkStealingRegionScheduler Self;
+  typedef Object                      Superclass;
+  typedef SmartPointer<Self>          Pointer;
+  typedef SmartPointer<const Self>    ConstPointer;
+
+  typedef TRegion                       RegionType;
+  typedef typename RegionType::SizeType  SizeType;
+  typedef typename RegionType::IndexType IndexType;
+
+  itkStaticConstMacro(ImageDimension, unsigned int, RegionType::ImageDimension);
+
+  /** Run-time type information (and related methods). */
+  itkTypeMacro(WorkStealingRegionScheduler, Object);
+
+  /** Method for creation through the object factory. */
+  itkNewMacro(Self);
+
+  /** Set/get the default tile size. Filters whose per-pixel cost
+   * varies use it to tile their output, while filters that work on
+   * larger units may choose other tiles. A size of zero along a
+   * dimension spans the region along that dimension. Defaults to 16
+   * pixels along each dimension but the last, along which tiles are
+   * one pixel thick. */
+  itkSetMacro(TileSize, SizeType);
+  itkGetConstReferenceMacro(TileSize, SizeType);
+
+  /** Clears the queues and the statistics for an update with the
+   * given number of threads. */
+  void Initialize(unsigned int numberOfThreads);
+
+  /** Splits a region into tiles of the default size and appends them
+   * to the queue of the given thread. */
+  void AddRegion(unsigned int threadId, const RegionType& region);
+
+  /** Splits a region into tiles of the given size and appends them to
+   * the queue of the given thread. */
+  void AddRegion(unsigned int threadId, const RegionType& region,
+                 const SizeType& tileSize);
+
+  /** Gets the next tile for the given thread, which marks the tile it
+   * got before as completed. Returns false when no tiles are left. */
+  bool GetNextTile(unsigned int threadId, RegionType& tile);
+
+  /** Reports the fraction of completed pixels to the filter and
+   * throws ProcessAborted if the filter was aborted. Only thread 0
+   * reports, as ProgressReporter does. */
+  void ReportProgress(ProcessObject* filter, unsigned int threadId) const;
+
+  /** Get the fraction of the queued pixels that were completed. */
+  double GetProgress() const;
+
+  /** Get the number of threads of the last update. */
+  unsigned int GetNumberOfThreads() const
+  {
+    return static_cast<unsigned int>(m_Queues.size());
+  }
+
+  /** Get the time in seconds the given thread spent on its tiles in
+   * the last update. */
+  double GetBusyTime(unsigned int threadId) const;
+
+  /** Get the number of tiles the given thread processed in the last
+   * update, including the stolen ones. */
+  unsigned long GetNumberOfTiles(unsigned int threadId) const;
+
+  /** Get the number of tiles the given thread stole from other
+   * threads in the last update. */
+  unsigned long GetNumberOfStolenTiles(unsigned int threadId) const;
+
+  /** Get the ratio of the longest busy time of a thread to the mean
+   * busy time in the last update. A perfectly balanced update has a
+   * ratio of one. */
+  double GetLoadImbalance() const;
+
+protected:
+  WorkStealingRegionScheduler();
+  ~WorkStealingRegionScheduler() {}
+  void PrintSelf(std::ostream& os, Indent indent) const;
+
+private:
+  WorkStealingRegionScheduler(const Self&); // purposely not implemented
+  void operator=(const Self&); // purposely not implemented
+
+  SizeType m_TileSize;
+
+  /** Tile queue of each thread. */
+  std::vector< std::deque<RegionType> > m_Queues;
+
+  /** Per-thread statistics, and the start time and size of the tile
+   * each thread is working on. A negative start time means the thread
+   * has no tile. */
+  std::vector<double>        m_BusyTime;
+  std::vector<unsigned long> m_NumberOfTiles;
+  std::vector<unsigned long> m_NumberOfStolenTiles;
+  std::vector<double>        m_TileStartTime;
+  std::vector<unsigned long> m_TilePixels;
+
+  unsigned long m_NumberOfPixels;
+  unsigned long m_NumberOfCompletedPixels;
+
+  RealTimeClock::Pointer m_Clock;
+
+  /** Guards the queues and the statistics. Tiles are coarse enough
+   * that a single lock does not contend. */
+  SimpleFastMutexLock m_Lock;
+};
+
+} // end namespace itk
+
+#ifndef ITK_MANUAL_INSTANTIATION
+#include "itkWorkStealingRegionScheduler.txx"
+#endif
+
+#endif // __itkWorkStealingRegionScheduler_h
@@ -0,0 +1,304 @@
+#ifndef __itkWorkStealingRegionScheduler_txx
+#define __itkWorkStealingRegionScheduler_txx
+
+#include "itkWorkStealingRegionScheduler.h"
+
+namespace itk
+{
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+WorkStealingRegionScheduler<TRegion>
+::WorkStealingRegionScheduler()
+{
+  m_TileSize.Fill(16);
+  m_TileSize[ImageDimension-1] = 1;
+
+  m_NumberOfPixels = 0;
+  m_NumberOfCompletedPixels = 0;
+
+  m_Clock = RealTimeClock::New();
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+void
+WorkStealingRegionScheduler<TRegion>
+::Initialize(unsigned int numberOfThreads)
+{
+  m_Lock.Lock();
+
+  m_Queues.clear();
+  m_Queues.resize(numberOfThreads);
+  m_BusyTime.assign(numberOfThreads, 0.0);
+  m_NumberOfTiles.assign(numberOfThreads, 0);
+  m_NumberOfStolenTiles.assign(numberOfThreads, 0);
+  m_TileStartTime.assign(numberOfThreads, -1.0);
+  m_TilePixels.assign(numberOfThreads, 0);
+
+  m_NumberOfPixels = 0;
+  m_NumberOfCompletedPixels = 0;
+
+  m_Lock.Unlock();
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+void
+WorkStealingRegionScheduler<TRegion>
+::AddRegion(unsigned int threadId, const RegionType& region)
+{
+  this->AddRegion(threadId, region, m_TileSize);
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+void
+WorkStealingRegionScheduler<TRegion>
+::AddRegion(unsigned int threadId, const RegionType& region,
+            const SizeType& tileSize)
+{
+  if (threadId >= m_Queues.size() || region.GetNumberOfPixels() == 0)
+    {
+    return;
+    }
+
+  SizeType size;
+  SizeType numberOfTiles;
+  for (unsigned int d = 0; d < ImageDimension; d++)
+    {
+    size[d] = tileSize[d] > 0 && tileSize[d] < region.GetSize()[d] ?
+      tileSize[d] : region.GetSize()[d];
+    numberOfTiles[d] = (region.GetSize()[d] + size[d] - 1) / size[d];
+    }
+
+  m_Lock.Lock();
+
+  // Visit the tiles in raster order, x fastest.
+  SizeType tile;
+  tile.Fill(0);
+  bool done = false;
+  while (!done)
+    {
+    IndexType tileIndex;
+    SizeType  tileExtent;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+      tileIndex[d] = region.GetIndex()[d] + static_cast<long>(tile[d] * size[d]);
+      tileExtent[d] = size[d];
+      if ((tile[d] + 1) * size[d] > region.GetSize()[d])
+        {
+        tileExtent[d] = region.GetSize()[d] - tile[d] * size[d];
+        }
+      }
+    m_Queues[threadId].push_back(RegionType(tileIndex, tileExtent));
+
+    done = true;
+    for (unsigned int d = 0; d < ImageDimension; d++)
+      {
+      if (++tile[d] < numberOfTiles[d])
+        {
+        done = false;
+        break;
+        }
+      tile[d] = 0;
+      }
+    }
+
+  m_NumberOfPixels += region.GetNumberOfPixels();
+
+  m_Lock.Unlock();
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+bool
+WorkStealingRegionScheduler<TRegion>
+::GetNextTile(unsigned int threadId, RegionType& tile)
+{
+  if (threadId >= m_Queues.size())
+    {
+    return false;
+    }
+
+  double now = m_Clock->GetTimeStamp();
+
+  m_Lock.Lock();
+
+  // Complete the previous tile of this thread.
+  if (m_TileStartTime[threadId] >= 0.0)
+    {
+    m_BusyTime[threadId] += now - m_TileStartTime[threadId];
+    m_NumberOfCompletedPixels += m_TilePixels[threadId];
+    }
+
+  bool found = false;
+  if (!m_Queues[threadId].empty())
+    {
+    tile = m_Queues[threadId].front();
+    m_Queues[threadId].pop_front();
+    found = true;
+    }
+  else
+    {
+    // Steal from the back of the longest queue.
+    unsigned int victim = threadId;
+    size_t longest = 0;
+    for (unsigned int i = 0; i < m_Queues.size(); i++)
+      {
+      if (m_Queues[i].size() > longest)
+        {
+        longest = m_Queues[i].size();
+        victim = i;
+        }
+      }
+    if (longest > 0)
+      {
+      tile = m_Queues[victim].back();
+      m_Queues[victim].pop_back();
+      m_NumberOfStolenTiles[threadId]++;
+      found = true;
+      }
+    }
+
+  if (found)
+    {
+    m_NumberOfTiles[threadId]++;
+    m_TileStartTime[threadId] = now;
+    m_TilePixels[threadId] = tile.GetNumberOfPixels();
+    }
+  else
+    {
+    m_TileStartTime[threadId] = -1.0;
+    m_TilePixels[threadId] = 0;
+    }
+
+  m_Lock.Unlock();
+
+  return found;
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+void
+WorkStealingRegionScheduler<TRegion>
+::ReportProgress(ProcessObject* filter, unsigned int threadId) const
+{
+  if (threadId != 0)
+    {
+    return;
+    }
+
+  filter->UpdateProgress(static_cast<float>(this->GetProgress()));
+
+  if (filter->GetAbortGenerateData())
+    {
+    std::string msg;
+    ProcessAborted e(__FILE__, __LINE__);
+    msg += "Object " + std::string(filter->GetNameOfClass()) + ": AbortGenerateDataOn";
+    e.SetDescription(msg);
+    throw e;
+    }
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+double
+WorkStealingRegionScheduler<TRegion>
+::GetProgress() const
+{
+  if (m_NumberOfPixels == 0)
+    {
+    return 1.0;
+    }
+
+  return static_cast<double>(m_NumberOfCompletedPixels) /
+    static_cast<double>(m_NumberOfPixels);
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+double
+WorkStealingRegionScheduler<TRegion>
+::GetBusyTime(unsigned int threadId) const
+{
+  return threadId < m_BusyTime.size() ? m_BusyTime[threadId] : 0.0;
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+unsigned long
+WorkStealingRegionScheduler<TRegion>
+::GetNumberOfTiles(unsigned int threadId) const
+{
+  return threadId < m_NumberOfTiles.size() ? m_NumberOfTiles[threadId] : 0;
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+unsigned long
+WorkStealingRegionScheduler<TRegion>
+::GetNumberOfStolenTiles(unsigned int threadId) const
+{
+  return threadId < m_NumberOfStolenTiles.size() ?
+    m_NumberOfStolenTiles[threadId] : 0;
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+double
+WorkStealingRegionScheduler<TRegion>
+::GetLoadImbalance() const
+{
+  double total = 0.0;
+  double longest = 0.0;
+  for (unsigned int i = 0; i < m_BusyTime.size(); i++)
+    {
+    total += m_BusyTime[i];
+    if (m_BusyTime[i] > longest)
+      {
+      longest = m_BusyTime[i];
+      }
+    }
+
+  if (total <= 0.0)
+    {
+    return 1.0;
+    }
+
+  return longest * static_cast<double>(m_BusyTime.size()) / total;
+}
+
+
+//----------------------------------------------------------------------------
+template <class TRegion>
+void
+WorkStealingRegionScheduler<TRegion>
+::PrintSelf(std::ostream& os, Indent indent) const
+{
+  Superclass::PrintSelf(os, indent);
+
+  os << indent << "TileSize: " << m_TileSize << std::endl;
+  os << indent << "NumberOfThreads: " << this->GetNumberOfThreads() << std::endl;
+  for (unsigned int i = 0; i < this->GetNumberOfThreads(); i++)
+    {
+    os << indent << "Thread " << i << ": BusyTime: " << m_BusyTime[i]
+       << " Tiles: " << m_NumberOfTiles[i]
+       << " StolenTiles: " << m_NumberOfStolenTiles[i] << std::endl;
+    }
+  os << indent << "LoadImbalance: " << this->GetLoadImbalance() << std::endl;
+}
+
+} // end namespace itk
+
+#endif // __itkWorkStealingRegionScheduler_txx